@@ -12,6 +12,9 @@
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
+// * To keep several disk requests in flight, get buffers with
+//     bgetblk or bread, start them with bread_async/bwrite_async,
+//     then biowait for each, or pass a completion callback.
 
 
 #include "types.h"
@@ -22,81 +25,357 @@
 #include "defs.h"
 #include "fs.h"
 #include "buf.h"
-#define BIO_BUCKETS 7U
+
+extern struct superblock sb;  // fs.c
+
+// Block types, for the disk I/O counters.
+enum { BT_SUPER, BT_LOG, BT_INODE, BT_BITMAP, BT_DATA, NBTYPE };
 
 static inline uint
 hash_to_bucket_idx(uint blockno) {
-  return blockno % BIO_BUCKETS;
+  return blockno % NBUCKET;
 }
 
+// Replacement, chosen at build time with BPOLICY:
+//
+// BPOLICY_LRU recycles the least recently released buffer.
+//
+// BPOLICY_2Q (Johnson and Shasha) keeps a block read for the
+// first time in the FIFO queue A1in, and remembers the blocks
+// recently pushed out of it in the ghost list A1out. Only a
+// block missed again while in A1out joins Am, the LRU queue of
+// hot blocks, so one big sequential scan churns through A1in
+// and leaves inodes, bitmaps and directories in Am alone.
+#define B2Q_KIN  (NBUF/4)   // A1in target size
+#define B2Q_KOUT (NBUF/2)   // A1out size
+
+enum { BQ_AM, BQ_A1IN };
 
+// All NBUF buffers live in one pool. A buffer sits in the hash
+// bucket of the block it caches, so lookups and brelse() take
+// only that bucket's lock. Buffers move between buckets only
+// when bget() recycles one, which holds evict_lock throughout:
+// that lets it hold two bucket locks at once, while nobody else
+// ever waits for a bucket lock holding another, so it cannot
+// deadlock. It also keeps any other process from adding the
+// same block to the cache meanwhile.
 struct bcache_row {
   struct spinlock lock;
-  struct buf buf[NBUF];
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
+  // Buffers cached in this bucket, through prev/next.
   struct buf head;
-} bcache[BIO_BUCKETS];
+
+  // Counters for blocks that hash here: hits are protected
+  // by lock, the rest by evict_lock.
+  uint hits;
+  uint misses;
+  uint evictions;  // valid blocks recycled from this bucket
+};
+
+struct {
+  struct spinlock evict_lock;
+  struct buf buf[NBUF];
+  struct bcache_row bucket[NBUCKET];
+
+  // Ticks once per brelse() of an unused buffer, for LRU.
+  uint clock;
+  // Processes in bget() that may wait for a free buffer.
+  int nwait;
+
+  // The rest is protected by evict_lock.
+  // Buffers in A1in.
+  int na1in;
+  // A1out, a ring of the blocks last pushed out of A1in.
+  struct {
+    uint dev;
+    uint blockno;
+  } a1out[B2Q_KOUT];
+  int a1out_next;
+
+  // Counters.
+  uint ghost_hits;
+  uint readaheads;
+  uint nio[NBTYPE][2];  // disk reads [0] and writes [1], by block type
+} bcache;
+
+static char *btname[NBTYPE] = {
+[BT_SUPER]   "super",
+[BT_LOG]     "log",
+[BT_INODE]   "inode",
+[BT_BITMAP]  "bitmap",
+[BT_DATA]    "data",
+};
+
+// Count a disk read or write of b's block, by which part of
+// the file system it is in.
+static void
+bcount(struct buf *b, int write)
+{
+  int t;
+
+  if(sb.size == 0 || b->blockno < sb.logstart)
+    t = BT_SUPER;
+  else if(b->blockno < sb.logstart + sb.nlog)
+    t = BT_LOG;
+  else if(b->blockno < sb.bmapstart)
+    t = BT_INODE;
+  else if(b->blockno < sb.bmapstart + sb.size/BPB + 1)
+    t = BT_BITMAP;
+  else
+    t = BT_DATA;
+  __sync_fetch_and_add(&bcache.nio[t][write], 1);
+}
 
 void
 binit(void)
 {
   struct buf *b;
 
-  for (uint i = 0; i < BIO_BUCKETS; ++i) {
-  initlock(&bcache[i].lock, "bcache");
+  for (uint d = 2; d * d <= NBUCKET; ++d) {
+    if (NBUCKET % d == 0) {
+      panic("binit: NBUCKET is not prime");
+    }
+  }
+
+  initlock(&bcache.evict_lock, "bcache.evict");
+  for (uint i = 0; i < NBUCKET; ++i) {
+    initlock(&bcache.bucket[i].lock, "bcache");
+    bcache.bucket[i].head.prev = &bcache.bucket[i].head;
+    bcache.bucket[i].head.next = &bcache.bucket[i].head;
+  }
 
-  // Create linked list of buffers
-  bcache[i].head.prev = &bcache[i].head;
-  bcache[i].head.next = &bcache[i].head;
-  for(b = bcache[i].buf; b < bcache[i].buf+NBUF; b++){
-    b->next = bcache[i].head.next;
-    b->prev = &bcache[i].head;
+  // Start all buffers out in bucket 0; they spread out as they
+  // are recycled.
+  struct bcache_row *row = &bcache.bucket[0];
+  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
+    b->queue = BQ_AM;
+    b->next = row->head.next;
+    b->prev = &row->head;
     initsleeplock(&b->lock, "buffer");
-    bcache[i].head.next->prev = b;
-    bcache[i].head.next = b;
+    row->head.next->prev = b;
+    row->head.next = b;
   }
-    printf("got i = %d\n", i);
+}
+
+// Find the buffer caching block (dev, blockno) in bucket i.
+// Caller must hold the bucket's lock.
+static struct buf*
+bfind(uint i, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bcache.bucket[i].head.next; b != &bcache.bucket[i].head; b = b->next){
+    if(b->dev == dev && b->blockno == blockno)
+      return b;
   }
+  return 0;
+}
+
+// Find the oldest unused buffer of queue q, or of any queue if
+// q < 0, and return it with the lock of its bucket, *vi, held.
+// Returns 0 if there is none.
+// Caller must hold evict_lock.
+static struct buf*
+bvictim(uint *vi, int q)
+{
+  struct buf *b, *victim = 0;
+  int better, held = -1;
+
+  for (uint j = 0; j < NBUCKET; ++j) {
+    acquire(&bcache.bucket[j].lock);
+    better = 0;
+    for(b = bcache.bucket[j].head.next; b != &bcache.bucket[j].head; b = b->next){
+      if(b->refcnt == 0 && (q < 0 || b->queue == q) &&
+         (victim == 0 || (int)(b->lastuse - victim->lastuse) < 0)){
+        victim = b;
+        better = 1;
+      }
+    }
+    if (better) {
+      if (held >= 0) {
+        release(&bcache.bucket[held].lock);
+      }
+      held = j;
+    } else {
+      release(&bcache.bucket[j].lock);
+    }
+  }
+  *vi = held;
+  return victim;
+}
+
+// Pick the buffer to recycle, as bvictim().
+// Caller must hold evict_lock.
+static struct buf*
+bevict(uint *vi)
+{
+  struct buf *b = 0;
+
+#if BPOLICY == BPOLICY_2Q
+  // Shrink A1in down to its target first, otherwise take the
+  // least recently used block of Am.
+  if(bcache.na1in > B2Q_KIN)
+    b = bvictim(vi, BQ_A1IN);
+  if(b == 0)
+    b = bvictim(vi, BQ_AM);
+#endif
+  if(b == 0)
+    b = bvictim(vi, -1);
+  if(b == 0)
+    return 0;
+
+#if BPOLICY == BPOLICY_2Q
+  if(b->queue == BQ_A1IN){
+    bcache.na1in--;
+    if(b->valid){
+      bcache.a1out[bcache.a1out_next].dev = b->dev;
+      bcache.a1out[bcache.a1out_next].blockno = b->blockno;
+      bcache.a1out_next = (bcache.a1out_next + 1) % B2Q_KOUT;
+    }
+  }
+#endif
+  return b;
+}
+
+// Decide which queue the newly cached block (dev, blockno) in b
+// joins. Caller must hold evict_lock.
+static void
+badmit(struct buf *b, uint dev, uint blockno)
+{
+  b->queue = BQ_AM;
+#if BPOLICY == BPOLICY_2Q
+  for(int i = 0; i < B2Q_KOUT; i++){
+    if(bcache.a1out[i].dev == dev && bcache.a1out[i].blockno == blockno){
+      // seen again soon after it left A1in: it is hot.
+      bcache.a1out[i].dev = 0;
+      bcache.ghost_hits++;
+      return;
+    }
+  }
+  b->queue = BQ_A1IN;
+  bcache.na1in++;
+#endif
 }
 
 // Look through buffer cache for block on device dev.
 // If not found, allocate a buffer.
 // In either case, return locked buffer.
+// For read-ahead, return 0 instead of a cached block, or
+// instead of waiting for a free buffer.
 static struct buf*
-bget(uint dev, uint blockno)
+bget(uint dev, uint blockno, int ahead)
 {
   struct buf *b;
   const uint i = hash_to_bucket_idx(blockno);
+  uint vi;
+  int waiting = 0;
 
-  acquire(&bcache[i].lock);
+  acquire(&bcache.bucket[i].lock);
 
   // Is the block already cached?
-  for(b = bcache[i].head.next; b != &bcache[i].head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache[i].lock);
-      acquiresleep(&b->lock);
-      return b;
+  if((b = bfind(i, dev, blockno)) != 0){
+    if(ahead){
+      release(&bcache.bucket[i].lock);
+      return 0;
     }
+    b->refcnt++;
+    bcache.bucket[i].hits++;
+    release(&bcache.bucket[i].lock);
+    acquiresleep(&b->lock);
+    return b;
   }
+  release(&bcache.bucket[i].lock);
 
   // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache[i].head.prev; b != &bcache[i].head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache[i].lock);
-      acquiresleep(&b->lock);
-      return b;
+  // Another process may have cached it before we got evict_lock.
+  acquire(&bcache.evict_lock);
+  acquire(&bcache.bucket[i].lock);
+  if((b = bfind(i, dev, blockno)) != 0){
+    if(ahead){
+      release(&bcache.bucket[i].lock);
+      release(&bcache.evict_lock);
+      return 0;
     }
+    b->refcnt++;
+    bcache.bucket[i].hits++;
+    release(&bcache.bucket[i].lock);
+    release(&bcache.evict_lock);
+    acquiresleep(&b->lock);
+    return b;
+  }
+  release(&bcache.bucket[i].lock);
+  if(ahead)
+    bcache.readaheads++;
+  else
+    bcache.bucket[i].misses++;
+
+  // Recycle an unused buffer. If there is none, scan once more
+  // with nwait set, so that any brelse() after that scan wakes
+  // us up, then wait for one.
+  while((b = bevict(&vi)) == 0){
+    if(ahead){
+      release(&bcache.evict_lock);
+      return 0;
+    }
+    if(waiting){
+      sleep(&bcache, &bcache.evict_lock);
+    } else {
+      bcache.nwait++;
+      waiting = 1;
+    }
+  }
+  if(waiting)
+    bcache.nwait--;
+
+  if(b->valid)
+    bcache.bucket[vi].evictions++;
+  badmit(b, dev, blockno);
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+  b->refcnt = 1;
+  b->lastuse = __sync_fetch_and_add(&bcache.clock, 1);
+  if(vi != i){
+    b->next->prev = b->prev;
+    b->prev->next = b->next;
+    release(&bcache.bucket[vi].lock);
+    acquire(&bcache.bucket[i].lock);
+    b->next = bcache.bucket[i].head.next;
+    b->prev = &bcache.bucket[i].head;
+    bcache.bucket[i].head.next->prev = b;
+    bcache.bucket[i].head.next = b;
+  }
+  release(&bcache.bucket[i].lock);
+  release(&bcache.evict_lock);
+  acquiresleep(&b->lock);
+  return b;
+}
+
+// Drop a reference to b, whose lock the caller has released.
+// Stamp it for LRU once it is unused.
+static void
+bunref(struct buf *b)
+{
+  int wake = 0;
+
+  const uint i = hash_to_bucket_idx(b->blockno);
+  acquire(&bcache.bucket[i].lock);
+  b->refcnt--;
+  if (b->refcnt == 0) {
+    // no one is waiting for it.
+    // A1in is FIFO: its buffers keep the stamp from bget().
+    if (b->queue != BQ_A1IN) {
+      b->lastuse = __sync_fetch_and_add(&bcache.clock, 1);
+    }
+    wake = bcache.nwait;
+  }
+  release(&bcache.bucket[i].lock);
+
+  if (wake) {
+    acquire(&bcache.evict_lock);
+    wakeup(&bcache);
+    release(&bcache.evict_lock);
   }
-  panic("bget: no buffers");
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -105,8 +384,9 @@ bread(uint dev, uint blockno)
 {
   struct buf *b;
 
-  b = bget(dev, blockno);
+  b = bget(dev, blockno, 0);
   if(!b->valid) {
+    bcount(b, 0);
     virtio_disk_rw(b, 0);
     b->valid = 1;
   }
@@ -119,11 +399,97 @@ bwrite(struct buf *b)
 {
   if(!holdingsleep(&b->lock))
     panic("bwrite");
+  bcount(b, 1);
   virtio_disk_rw(b, 1);
 }
 
+// Return a locked buf for the indicated block, without reading
+// it from disk; b->valid says whether it holds the block yet.
+struct buf*
+bgetblk(uint dev, uint blockno)
+{
+  return bget(dev, blockno, 0);
+}
+
+// Start reading the block of locked buf b, unless it is valid,
+// and return without waiting for the disk. If done is 0, call
+// biowait(b) before looking at b->data. Otherwise the disk
+// interrupt handler calls done(b) when b->data holds the block,
+// or bread_async() does so at once if it already did; done()
+// must not sleep.
+void
+bread_async(struct buf *b, void (*done)(struct buf*))
+{
+  if(!holdingsleep(&b->lock))
+    panic("bread_async");
+  if(b->valid){
+    if(done)
+      done(b);
+    return;
+  }
+  // nobody else can look at b->data before b is released.
+  b->valid = 1;
+  b->iodone = done;
+  bcount(b, 0);
+  virtio_disk_submit(b, 0);
+}
+
+// Start writing locked buf b to disk, and return without
+// waiting for the disk; done is as for bread_async().
+// b->data must not change until the write has finished.
+void
+bwrite_async(struct buf *b, void (*done)(struct buf*))
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwrite_async");
+  b->iodone = done;
+  bcount(b, 1);
+  virtio_disk_submit(b, 1);
+}
+
+// Wait for the I/O started on b without a callback to finish.
+void
+biowait(struct buf *b)
+{
+  virtio_disk_wait(b);
+}
+
+// Hold back the async I/O started until the matching bunplug(),
+// so that requests for adjacent blocks go to the disk as one.
+void
+bplug(void)
+{
+  virtio_disk_plug();
+}
+
+void
+bunplug(void)
+{
+  virtio_disk_unplug();
+}
+
+// Completion for read-ahead: the block is in the cache now,
+// release b for whoever reads it.
+static void
+bahead_done(struct buf *b)
+{
+  releasesleep(&b->lock);
+  bunref(b);
+}
+
+// Start reading block (dev, blockno) into the cache, unless it
+// is cached already, without waiting for the disk.
+void
+breadahead(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  if((b = bget(dev, blockno, 1)) == 0)
+    return;
+  bread_async(b, bahead_done);
+}
+
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
 void
 brelse(struct buf *b)
 {
@@ -131,37 +497,53 @@ brelse(struct buf *b)
     panic("brelse");
 
   releasesleep(&b->lock);
-
-  const uint i = hash_to_bucket_idx(b->blockno);
-  acquire(&bcache[i].lock);
-  b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache[i].head.next;
-    b->prev = &bcache[i].head;
-    bcache[i].head.next->prev = b;
-    bcache[i].head.next = b;
-  }
-  
-  release(&bcache[i].lock);
+  bunref(b);
 }
 
 void
 bpin(struct buf *b) {
   const uint i = hash_to_bucket_idx(b->blockno);
-  acquire(&bcache[i].lock);
+  acquire(&bcache.bucket[i].lock);
   b->refcnt++;
-  release(&bcache[i].lock);
+  release(&bcache.bucket[i].lock);
 }
 
 void
 bunpin(struct buf *b) {
   const uint i = hash_to_bucket_idx(b->blockno);
-  acquire(&bcache[i].lock);
+  acquire(&bcache.bucket[i].lock);
   b->refcnt--;
-  release(&bcache[i].lock);
+  release(&bcache.bucket[i].lock);
 }
 
+// Print the buffer cache counters into buf, for statistics(),
+// each line a name and its values.
+int
+bstats(char *buf, int sz)
+{
+#if BPOLICY == BPOLICY_2Q
+  char *policy = "2q";
+#else
+  char *policy = "lru";
+#endif
+  uint hits = 0, misses = 0, evictions = 0;
+  int n = 0;
 
+  for(int i = 0; i < NBUCKET; i++){
+    hits += bcache.bucket[i].hits;
+    misses += bcache.bucket[i].misses;
+    evictions += bcache.bucket[i].evictions;
+  }
+  n += snprintf(buf+n, sz-n, "# bcache %s: hits misses evictions ghost-hits readahead\n", policy);
+  n += snprintf(buf+n, sz-n, "bcache %d %d %d %d %d\n", hits, misses, evictions,
+                bcache.ghost_hits, bcache.readaheads);
+  n += snprintf(buf+n, sz-n, "# bcache.<bucket>: hits misses evictions\n");
+  for(int i = 0; i < NBUCKET; i++)
+    n += snprintf(buf+n, sz-n, "bcache.%d %d %d %d\n", i, bcache.bucket[i].hits,
+                  bcache.bucket[i].misses, bcache.bucket[i].evictions);
+  n += snprintf(buf+n, sz-n, "# bio.<block type>: disk reads writes\n");
+  for(int t = 0; t < NBTYPE; t++)
+    n += snprintf(buf+n, sz-n, "bio.%s %d %d\n", btname[t],
+                  bcache.nio[t][0], bcache.nio[t][1]);
+  return n;
+}
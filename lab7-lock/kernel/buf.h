@@ -5,11 +5,17 @@
 struct buf {
   int valid;   // has data been read from disk?
   int disk;    // does disk "own" buf?
+  int diskwrite; // queued to be written, not read?
+  struct buf *qnext; // disk queue, and bufs merged into a request
+  uint64 qtime; // when queued for the disk, see iosched.c
+  void (*iodone)(struct buf*); // async I/O completion, see bio.c
   uint dev;
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
+  uint lastuse; // bcache clock when last released, for LRU
+  int queue;    // replacement queue, see bio.c
+  struct buf *prev; // hash bucket list
   struct buf *next;
   uchar data[BSIZE];
 };
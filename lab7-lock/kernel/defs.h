@@ -24,6 +24,14 @@ void            brelse(struct buf*);
 void            bwrite(struct buf*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+void            breadahead(uint, uint);
+struct buf*     bgetblk(uint, uint);
+void            bread_async(struct buf*, void (*)(struct buf*));
+void            bwrite_async(struct buf*, void (*)(struct buf*));
+void            biowait(struct buf*);
+void            bplug(void);
+void            bunplug(void);
+int             bstats(char*, int);
 
 // console.c
 void            consoleinit(void);
@@ -98,6 +106,7 @@ void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
 int             kill(int);
+void            kthread(char*, void (*)(void));
 struct cpu*     mycpu(void);
 struct cpu*     getmycpu(void);
 struct proc*    myproc();
@@ -190,9 +199,20 @@ void            plicinithart(void);
 int             plic_claim(void);
 void            plic_complete(int);
 
+// iosched.c
+void            iosched_init(void);
+void            iosched_add(struct buf*);
+struct buf*     iosched_next(int, int*);
+void            iosched_done(struct buf*);
+int             iostats(char*, int);
+
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
+void            virtio_disk_submit(struct buf *, int);
+void            virtio_disk_wait(struct buf *);
+void            virtio_disk_plug(void);
+void            virtio_disk_unplug(void);
 void            virtio_disk_intr(void);
 
 // number of elements in fixed-size array
@@ -38,6 +38,10 @@ struct inode {
   short nlink;
   uint size;
   uint addrs[NDIRECT+1];
+
+  uint ra_next;       // block after the last one readi() read
+  uint ra_end;        // read-ahead has been started up to here
+  uint ra_win;        // read-ahead window, in blocks
 };
 
 // map major device number to device functions.
@@ -267,6 +267,7 @@ iget(uint dev, uint inum)
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->ra_next = ip->ra_end = ip->ra_win = 0;
   release(&itable.lock);
 
   return ip;
@@ -448,6 +449,38 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// Sequential read-ahead. When readi() goes on to the block
+// after the one it read last, start reading the next ra_win
+// blocks of the file without waiting for them, and double the
+// window, up to READAHEAD blocks, for as long as the reads stay
+// sequential. Any other access starts over.
+// Caller must hold ip->lock.
+static void
+readahead(struct inode *ip, uint bn)
+{
+  uint end, last;
+
+  if(bn + 1 == ip->ra_next)
+    return;  // the same block again
+  if(bn != ip->ra_next || ip->ra_win == 0){
+    ip->ra_win = bn == ip->ra_next ? 1 : 0;
+    ip->ra_end = bn + 1;
+  } else if(ip->ra_win < READAHEAD){
+    ip->ra_win = min(ip->ra_win * 2, READAHEAD);
+  }
+  ip->ra_next = bn + 1;
+  if(ip->ra_end < bn + 1)
+    ip->ra_end = bn + 1;
+
+  // stay inside the file, where bmap() allocates nothing.
+  last = (ip->size + BSIZE - 1) / BSIZE;
+  end = min(bn + 1 + ip->ra_win, last);
+  bplug();
+  for(; ip->ra_end < end; ip->ra_end++)
+    breadahead(ip->dev, bmap(ip, ip->ra_end));
+  bunplug();
+}
+
 // Read data from inode.
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
@@ -464,6 +497,7 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
     n = ip->size - off;
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
+    readahead(ip, off/BSIZE);
     bp = bread(ip->dev, bmap(ip, off/BSIZE));
     m = min(n - tot, BSIZE - off%BSIZE);
     if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
@@ -0,0 +1,237 @@
+// Disk I/O scheduler.
+//
+// virtio_disk.c queues each buf here, and takes requests off
+// whenever the device has descriptors free for them. Which
+// request goes next is up to the policy, chosen at build time:
+//
+// * noop hands bufs over in arrival order, merging runs of
+//   adjacent blocks.
+//
+// * deadline keeps reads and writes apart, each sorted by block
+//   number, and sweeps them in one direction (C-SCAN), merging
+//   adjacent blocks. Reads go first, since a process is usually
+//   asleep waiting for them, while writes are mostly log and
+//   write-back traffic; but writes get a turn after WRITES_STARVED
+//   read requests. A request that has waited past its deadline is
+//   served before the sweep picks up again.
+//
+// All the functions here but iostats() must be called with the
+// disk lock held.
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "buf.h"
+
+// r_time() runs at 10 MHz in qemu.
+#define TICKS_PER_US    10
+
+#define READ_EXPIRE     (500*1000*TICKS_PER_US)   // 0.5 s
+#define WRITE_EXPIRE    (5000*1000*TICKS_PER_US)  // 5 s
+#define WRITES_STARVED  2
+
+// latency histogram buckets: under 1, 2, 4, ... us, and the rest.
+#define NLATHIST        20
+
+struct iosched {
+  char *name;
+  void (*add)(struct buf*);
+  // take the next request off the queue: up to max bufs of
+  // adjacent blocks, linked through qnext. returns 0 if none.
+  struct buf *(*next)(int max, int *n);
+};
+
+static struct {
+  struct buf *fifo;       // noop: queued bufs, in arrival order
+  struct buf **ftail;
+  struct buf *sorted[2];  // deadline: reads [0], writes [1], by blockno
+  uint head;              // deadline: the sweep continues from here
+  int starved;            // deadline: reads served while writes waited
+
+  // statistics.
+  int queued;             // waiting here
+  int inflight;           // handed to the device
+  int maxqueued;
+  int maxinflight;
+  int nreq[2];            // completed reads [0] and writes [1]
+  uint64 lat[2];          // ... their total latency, in r_time() ticks
+  uint64 maxlat[2];
+  uint lathist[2][NLATHIST];
+} sq;
+
+// take the run of adjacent blocks starting at *pp off its list.
+static struct buf*
+takerun(struct buf **pp, int max, int *n)
+{
+  struct buf *b = *pp, *last = b;
+
+  for(*n = 1; *n < max && last->qnext; last = last->qnext, (*n)++){
+    struct buf *nb = last->qnext;
+    if(nb->diskwrite != b->diskwrite || nb->dev != b->dev ||
+       nb->blockno != last->blockno + 1)
+      break;
+  }
+  *pp = last->qnext;
+  last->qnext = 0;
+  return b;
+}
+
+static void
+noop_add(struct buf *b)
+{
+  *sq.ftail = b;
+  sq.ftail = &b->qnext;
+}
+
+static struct buf*
+noop_next(int max, int *n)
+{
+  struct buf *b;
+
+  if(sq.fifo == 0)
+    return 0;
+  b = takerun(&sq.fifo, max, n);
+  if(sq.fifo == 0)
+    sq.ftail = &sq.fifo;
+  return b;
+}
+
+static void
+deadline_add(struct buf *b)
+{
+  struct buf **pp = &sq.sorted[b->diskwrite];
+
+  while(*pp && ((*pp)->dev < b->dev ||
+                ((*pp)->dev == b->dev && (*pp)->blockno < b->blockno)))
+    pp = &(*pp)->qnext;
+  b->qnext = *pp;
+  *pp = b;
+}
+
+static struct buf*
+deadline_next(int max, int *n)
+{
+  struct buf **pp, **oldest, *b, *last;
+  int dir;
+
+  if(sq.sorted[0] && (sq.sorted[1] == 0 || sq.starved < WRITES_STARVED)){
+    dir = 0;
+    if(sq.sorted[1])
+      sq.starved++;
+  } else if(sq.sorted[1]){
+    dir = 1;
+    sq.starved = 0;
+  } else {
+    return 0;
+  }
+
+  // serve the oldest request first if it has waited too long;
+  // otherwise continue the sweep, wrapping at the end.
+  oldest = &sq.sorted[dir];
+  for(pp = &sq.sorted[dir]; *pp; pp = &(*pp)->qnext)
+    if((*pp)->qtime < (*oldest)->qtime)
+      oldest = pp;
+  if(r_time() - (*oldest)->qtime > (dir ? WRITE_EXPIRE : READ_EXPIRE)){
+    pp = oldest;
+  } else {
+    for(pp = &sq.sorted[dir]; *pp && (*pp)->blockno < sq.head; pp = &(*pp)->qnext)
+      ;
+    if(*pp == 0)
+      pp = &sq.sorted[dir];
+  }
+
+  b = takerun(pp, max, n);
+  for(last = b; last->qnext; last = last->qnext)
+    ;
+  sq.head = last->blockno + 1;
+  return b;
+}
+
+static struct iosched schedulers[] = {
+  [IOSCHED_NOOP]     { "noop", noop_add, noop_next },
+  [IOSCHED_DEADLINE] { "deadline", deadline_add, deadline_next },
+};
+
+static struct iosched *policy = &schedulers[IOSCHED];
+
+void
+iosched_init(void)
+{
+  sq.ftail = &sq.fifo;
+}
+
+// queue b, whose diskwrite says which way it goes.
+void
+iosched_add(struct buf *b)
+{
+  b->qnext = 0;
+  b->qtime = r_time();
+  policy->add(b);
+  if(++sq.queued > sq.maxqueued)
+    sq.maxqueued = sq.queued;
+}
+
+// take the next request to hand to the device: up to max bufs
+// of adjacent blocks going the same way, linked through qnext,
+// with their number in *n. returns 0 if nothing is queued.
+struct buf*
+iosched_next(int max, int *n)
+{
+  struct buf *b;
+
+  if((b = policy->next(max, n)) == 0)
+    return 0;
+  sq.queued -= *n;
+  sq.inflight += *n;
+  if(sq.inflight > sq.maxinflight)
+    sq.maxinflight = sq.inflight;
+  return b;
+}
+
+// the device has finished with b.
+void
+iosched_done(struct buf *b)
+{
+  uint64 t = r_time() - b->qtime;
+  int dir = b->diskwrite;
+  int h;
+
+  sq.inflight--;
+  sq.nreq[dir]++;
+  sq.lat[dir] += t;
+  if(t > sq.maxlat[dir])
+    sq.maxlat[dir] = t;
+  for(h = 0; h < NLATHIST-1 && t >= ((uint64)TICKS_PER_US << h); h++)
+    ;
+  sq.lathist[dir][h]++;
+}
+
+// Print the scheduler counters into buf, for statistics(),
+// each line a name and its values. latencies are in
+// microseconds, from queueing to completion.
+int
+iostats(char *buf, int sz)
+{
+  static char *dirname[2] = { "read", "write" };
+  int n = 0;
+
+  n += snprintf(buf+n, sz-n, "# iosched %s: queued max inflight max\n", policy->name);
+  n += snprintf(buf+n, sz-n, "iosched %d %d %d %d\n",
+                sq.queued, sq.maxqueued, sq.inflight, sq.maxinflight);
+  n += snprintf(buf+n, sz-n, "# iosched.<dir>: requests avg-us max-us\n");
+  n += snprintf(buf+n, sz-n, "# iosched.<dir>.lat: requests under 1 2 4 ... us, then the rest\n");
+  for(int d = 0; d < 2; d++){
+    n += snprintf(buf+n, sz-n, "iosched.%s %d %d %d\n", dirname[d], sq.nreq[d],
+                  sq.nreq[d] ? (int)(sq.lat[d] / sq.nreq[d] / TICKS_PER_US) : 0,
+                  (int)(sq.maxlat[d] / TICKS_PER_US));
+    n += snprintf(buf+n, sz-n, "iosched.%s.lat", dirname[d]);
+    for(int h = 0; h < NLATHIST; h++)
+      n += snprintf(buf+n, sz-n, " %d", sq.lathist[d][h]);
+    n += snprintf(buf+n, sz-n, "\n");
+  }
+  return n;
+}
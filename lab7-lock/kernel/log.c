@@ -21,6 +21,14 @@
 // But if it thinks the log is close to running out, it
 // sleeps until the last outstanding end_op() commits.
 //
+// Commits are delayed: a transaction stays open, its modified
+// blocks pinned in the buffer cache, until the log is close to
+// full or the flusher thread finds it has been open WBDELAY
+// ticks. Repeated writes to a block in the meantime cost
+// nothing but the memory copy, and system calls don't wait
+// for the disk. A crash loses at most the last WBDELAY ticks
+// of updates, but never part of a transaction.
+//
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
 //   header block, containing block #s for block A, B, C, ...
@@ -43,13 +51,18 @@ struct log {
   int size;
   int outstanding; // how many FS sys calls are executing.
   int committing;  // in commit(), please wait.
+  int closing;     // flusher wants a commit; no new FS sys calls.
+  uint dirtied;    // ticks when the open transaction logged its first block.
   int dev;
   struct logheader lh;
 };
 struct log log;
 
+#define LOGBATCH 8  // block writes in flight at once during a commit
+
 static void recover_from_log(void);
 static void commit();
+static void flusher(void);
 
 void
 initlog(int dev, struct superblock *sb)
@@ -62,23 +75,34 @@ initlog(int dev, struct superblock *sb)
   log.size = sb->nlog;
   log.dev = dev;
   recover_from_log();
+  kthread("logflush", flusher);
 }
 
-// Copy committed blocks from log to their home location
+// Copy committed blocks from log to their home location,
+// keeping up to LOGBATCH writes in flight.
 static void
 install_trans(int recovering)
 {
-  int tail;
-
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
+  struct buf *dbufs[LOGBATCH];
+  int tail, n;
+
+  for (tail = 0; tail < log.lh.n; tail += n) {
+    bplug();
+    for (n = 0; n < LOGBATCH && tail + n < log.lh.n; n++) {
+      struct buf *lbuf = bread(log.dev, log.start+tail+n+1); // read log block
+      struct buf *dbuf = bread(log.dev, log.lh.block[tail+n]); // read dst
+      memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
+      brelse(lbuf);
+      bwrite_async(dbuf, 0);  // write dst to disk
+      dbufs[n] = dbuf;
+    }
+    bunplug();
+    for (int i = 0; i < n; i++) {
+      biowait(dbufs[i]);
+      if(recovering == 0)
+        bunpin(dbufs[i]);
+      brelse(dbufs[i]);
+    }
   }
 }
 
@@ -128,7 +152,7 @@ begin_op(void)
 {
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.committing || log.closing){
       sleep(&log, &log.lock);
     } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
       // this op might exhaust log space; wait for commit.
@@ -141,20 +165,35 @@ begin_op(void)
   }
 }
 
+// commit the open transaction.
+// caller holds log.lock, and no FS sys calls are executing.
+static void
+docommit(void)
+{
+  log.committing = 1;
+  // call commit w/o holding locks, since not allowed
+  // to sleep with locks.
+  release(&log.lock);
+  commit();
+  acquire(&log.lock);
+  log.committing = 0;
+  log.closing = 0;
+  wakeup(&log);
+}
+
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// commits if this was the last outstanding operation, and
+// the flusher asked for it or another op might not fit.
 void
 end_op(void)
 {
-  int do_commit = 0;
-
   acquire(&log.lock);
   log.outstanding -= 1;
   if(log.committing)
     panic("log.committing");
-  if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
+  if(log.outstanding == 0 &&
+     (log.closing || log.lh.n + MAXOPBLOCKS > LOGSIZE)){
+    docommit();
   } else {
     // begin_op() may be waiting for log space,
     // and decrementing log.outstanding has decreased
@@ -162,31 +201,74 @@ end_op(void)
     wakeup(&log);
   }
   release(&log.lock);
+}
+
+// Commit the open transaction once it has been open WBDELAY
+// ticks, waiting for the FS sys calls in it to finish.
+static void
+flusher(void)
+{
+  uint now;
+
+  for(;;){
+    acquire(&tickslock);
+    uint t0 = ticks;
+    while(ticks - t0 < WBDELAY/4)
+      sleep(&ticks, &tickslock);
+    now = ticks;
+    release(&tickslock);
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
     acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
+    if(log.lh.n > 0 && !log.committing && now - log.dirtied >= WBDELAY){
+      if(log.outstanding == 0)
+        docommit();
+      else
+        log.closing = 1;  // the last end_op() commits
+    }
     release(&log.lock);
   }
 }
 
-// Copy modified blocks from cache to log.
+// Copy modified blocks from cache to log, keeping up to
+// LOGBATCH writes in flight; the disk gets adjacent log
+// blocks as one request.
 static void
 write_log(void)
 {
-  int tail;
-
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+  struct buf *tos[LOGBATCH];
+  int tail, n;
+
+  for (tail = 0; tail < log.lh.n; tail += n) {
+    bplug();
+    for (n = 0; n < LOGBATCH && tail + n < log.lh.n; n++) {
+      // the whole log block is overwritten, no need to read it.
+      struct buf *to = bgetblk(log.dev, log.start+tail+n+1); // log block
+      struct buf *from = bread(log.dev, log.lh.block[tail+n]); // cache block
+      memmove(to->data, from->data, BSIZE);
+      to->valid = 1;
+      brelse(from);
+      bwrite_async(to, 0);  // write the log
+      tos[n] = to;
+    }
+    bunplug();
+    for (int i = 0; i < n; i++) {
+      biowait(tos[i]);
+      brelse(tos[i]);
+    }
+  }
+}
+
+// Sort the logged block numbers, so that install_trans()
+// writes the home locations in one sweep across the disk.
+static void
+sort_head(void)
+{
+  for (int i = 1; i < log.lh.n; i++) {
+    int b = log.lh.block[i];
+    int j;
+    for (j = i; j > 0 && log.lh.block[j-1] > b; j--)
+      log.lh.block[j] = log.lh.block[j-1];
+    log.lh.block[j] = b;
   }
 }
 
@@ -194,6 +276,7 @@ static void
 commit()
 {
   if (log.lh.n > 0) {
+    sort_head();
     write_log();     // Write modified blocks from cache to log
     write_head();    // Write header to disk -- the real commit
     install_trans(0); // Now install writes to home locations
@@ -229,7 +312,11 @@ log_write(struct buf *b)
   log.lh.block[i] = b->blockno;
   if (i == log.lh.n) {  // Add new block to log?
     bpin(b);
-    log.lh.n++;
+    if (log.lh.n++ == 0) {
+      acquire(&tickslock);
+      log.dirtied = ticks;
+      release(&tickslock);
+    }
   }
   release(&log.lock);
 }
@@ -2,7 +2,7 @@
 #ifndef PARAM_H
 #define PARAM_H
 
-#define NPROC        64  // maximum number of processes
+#define NPROC        65  // maximum number of processes, and the log flusher
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
 #define NFILE       100  // open files per system
@@ -12,7 +12,24 @@
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
+#define WBDELAY      30  // max ticks modified blocks wait to be committed
+#define NBUF         (MAXOPBLOCKS*6)  // size of disk block cache
+#define READAHEAD    8   // max blocks of sequential read-ahead
+#define NBUCKET      13  // disk block cache hash buckets (prime)
+
+// disk block cache replacement policies, see bio.c
+#define BPOLICY_LRU   0
+#define BPOLICY_2Q    1
+#ifndef BPOLICY
+#define BPOLICY      BPOLICY_2Q
+#endif
+
+// disk I/O schedulers, see iosched.c
+#define IOSCHED_NOOP      0
+#define IOSCHED_DEADLINE  1
+#ifndef IOSCHED
+#define IOSCHED      IOSCHED_DEADLINE
+#endif
 #define FSSIZE       1000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
 
@@ -39,6 +39,8 @@ statsread(int user_dst, uint64 dst, int n)
 #endif
 #ifdef LAB_LOCK
     stats.sz = statslock(stats.buf, BUFSZ);
+    stats.sz += bstats(stats.buf + stats.sz, BUFSZ - stats.sz);
+    stats.sz += iostats(stats.buf + stats.sz, BUFSZ - stats.sz);
 #endif
   }
   m = stats.sz - stats.off;
@@ -48,8 +48,12 @@
 #define VIRTIO_RING_F_EVENT_IDX     29
 
 // this many virtio descriptors.
-// must be a power of two.
-#define NUM 8
+// must be a power of two, and small enough that the
+// descriptors and the avail ring fit in one page.
+#define NUM 64
+
+// at most this many adjacent blocks are merged into one request.
+#define MAXMERGE 8
 
 // a single descriptor, from the spec.
 struct virtq_desc {
@@ -60,13 +64,14 @@ struct virtq_desc {
 };
 #define VRING_DESC_F_NEXT  1 // chained with another descriptor
 #define VRING_DESC_F_WRITE 2 // device writes (vs read)
+#define VRING_DESC_F_INDIRECT 4 // addr points to a table of descriptors
 
 // the (entire) avail ring, from the spec.
 struct virtq_avail {
   uint16 flags; // always zero
   uint16 idx;   // driver will write ring[idx] next
   uint16 ring[NUM]; // descriptor numbers of chain heads
-  uint16 unused;
+  uint16 used_event; // with EVENT_IDX: interrupt when used idx passes this
 };
 
 // one entry in the "used" ring, with which the
@@ -80,6 +85,7 @@ struct virtq_used {
   uint16 flags; // always zero
   uint16 idx;   // device increments when it adds a ring[] entry
   struct virtq_used_elem ring[NUM];
+  uint16 avail_event; // with EVENT_IDX: notify when avail idx passes this
 };
 
 // these are specific to virtio block devices, e.g. disks,
@@ -55,19 +55,36 @@ static struct disk {
 
   // our own book-keeping.
   char free[NUM];  // is a descriptor free?
+  int nfree;
   uint16 used_idx; // we've looked this far in used[2..NUM].
 
   // track info about in-flight operations,
   // for use when completion interrupt arrives.
   // indexed by first descriptor index of chain.
   struct {
-    struct buf *b;
+    struct buf *b;  // and the bufs merged after it, through qnext
     char status;
   } info[NUM];
 
+  // while non-zero, virtio_disk_submit() leaves bufs in the
+  // I/O scheduler, so that adjacent ones can be merged.
+  int plugged;
+
   // disk command headers.
   // one-for-one with descriptors, for convenience.
   struct virtio_blk_req ops[NUM];
+
+  // with VIRTIO_RING_F_INDIRECT_DESC, a request takes a single
+  // descriptor, which points to the request's own table here, so
+  // NUM requests rather than NUM/3 can be in flight, and each
+  // can carry up to MAXMERGE blocks.
+  struct virtq_desc ind[NUM][MAXMERGE+2];
+  int indirect;
+
+  // with VIRTIO_RING_F_EVENT_IDX, the device tells us when it
+  // wants to be notified of new requests, and we tell it when we
+  // want an interrupt; it leaves out the rest while busy.
+  int event_idx;
   
   struct spinlock vdisk_lock;
   
@@ -100,9 +117,9 @@ virtio_disk_init(void)
   features &= ~(1 << VIRTIO_BLK_F_CONFIG_WCE);
   features &= ~(1 << VIRTIO_BLK_F_MQ);
   features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
-  features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
-  features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
   *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
+  disk.indirect = (features >> VIRTIO_RING_F_INDIRECT_DESC) & 1;
+  disk.event_idx = (features >> VIRTIO_RING_F_EVENT_IDX) & 1;
 
   // tell device that feature negotiation is complete.
   status |= VIRTIO_CONFIG_S_FEATURES_OK;
@@ -136,6 +153,8 @@ virtio_disk_init(void)
   // all NUM descriptors start out unused.
   for(int i = 0; i < NUM; i++)
     disk.free[i] = 1;
+  disk.nfree = NUM;
+  iosched_init();
 
   // plic.c and trap.c arrange for interrupts from VIRTIO0_IRQ.
 }
@@ -147,6 +166,7 @@ alloc_desc()
   for(int i = 0; i < NUM; i++){
     if(disk.free[i]){
       disk.free[i] = 0;
+      disk.nfree--;
       return i;
     }
   }
@@ -166,7 +186,7 @@ free_desc(int i)
   disk.desc[i].flags = 0;
   disk.desc[i].next = 0;
   disk.free[i] = 1;
-  wakeup(&disk.free[0]);
+  disk.nfree++;
 }
 
 // free a chain of descriptors.
@@ -200,27 +220,55 @@ alloc3_desc(int *idx)
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// does an event index ask for a notify or an interrupt, now that
+// the index it watches moved from old to new? from the spec.
+static int
+vring_need_event(uint16 event, uint16 new, uint16 old)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
+  return (uint16)(new - event - 1) < (uint16)(new - old);
+}
 
-  acquire(&disk.vdisk_lock);
+// hand the device a request for the n bufs of adjacent blocks
+// starting at b, linked through qnext, without waiting for it.
+// caller must hold vdisk_lock, and have checked that there are
+// enough free descriptors.
+static void
+virtio_disk_start(struct buf *b, int n)
+{
+  uint64 sector = b->blockno * (BSIZE / 512);
+  int write = b->diskwrite;
 
   // the spec's Section 5.2 says that legacy block operations use
   // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
+  // data, one for a 1-byte status result. a request for n blocks
+  // has n data descriptors.
 
-  // allocate the three descriptors.
+  // allocate the descriptors: a single one that points at an
+  // indirect table, or a chain of three.
+  struct virtq_desc *d[MAXMERGE+2];
   int idx[3];
-  while(1){
-    if(alloc3_desc(idx) == 0) {
-      break;
+  if(disk.indirect) {
+    if((idx[0] = alloc_desc()) < 0)
+      panic("virtio_disk_start");
+    struct virtq_desc *ind = disk.ind[idx[0]];
+    disk.desc[idx[0]].addr = (uint64) ind;
+    disk.desc[idx[0]].len = (n+2) * sizeof(struct virtq_desc);
+    disk.desc[idx[0]].flags = VRING_DESC_F_INDIRECT;
+    disk.desc[idx[0]].next = 0;
+    for(int i = 0; i < n+2; i++){
+      d[i] = &ind[i];
+      d[i]->next = i+1;
     }
-    sleep(&disk.free[0], &disk.vdisk_lock);
+  } else {
+    if(n != 1 || alloc3_desc(idx) != 0)
+      panic("virtio_disk_start");
+    for(int i = 0; i < 3; i++)
+      d[i] = &disk.desc[idx[i]];
+    d[0]->next = idx[1];
+    d[1]->next = idx[2];
   }
 
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
   struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
@@ -232,28 +280,28 @@ virtio_disk_rw(struct buf *b, int write)
   buf0->reserved = 0;
   buf0->sector = sector;
 
-  disk.desc[idx[0]].addr = (uint64) buf0;
-  disk.desc[idx[0]].len = sizeof(struct virtio_blk_req);
-  disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
-  disk.desc[idx[0]].next = idx[1];
+  d[0]->addr = (uint64) buf0;
+  d[0]->len = sizeof(struct virtio_blk_req);
+  d[0]->flags = VRING_DESC_F_NEXT;
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  struct buf *nb = b;
+  for(int i = 1; i <= n; i++, nb = nb->qnext){
+    d[i]->addr = (uint64) nb->data;
+    d[i]->len = BSIZE;
+    if(write)
+      d[i]->flags = 0; // device reads b->data
+    else
+      d[i]->flags = VRING_DESC_F_WRITE; // device writes b->data
+    d[i]->flags |= VRING_DESC_F_NEXT;
+  }
 
   disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+  d[n+1]->addr = (uint64) &disk.info[idx[0]].status;
+  d[n+1]->len = 1;
+  d[n+1]->flags = VRING_DESC_F_WRITE; // device writes the status
+  d[n+1]->next = 0;
 
   // record struct buf for virtio_disk_intr().
-  b->disk = 1;
   disk.info[idx[0]].b = b;
 
   // tell the device the first index in our chain of descriptors.
@@ -262,26 +310,103 @@ virtio_disk_rw(struct buf *b, int write)
   __sync_synchronize();
 
   // tell the device another avail ring entry is available.
+  uint16 old = disk.avail->idx;
   disk.avail->idx += 1; // not % NUM ...
 
   __sync_synchronize();
 
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+  // a device still working through the ring will find the
+  // new entry without being told.
+  if(!disk.event_idx ||
+     vring_need_event(disk.used->avail_event, disk.avail->idx, old))
+    *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+}
+
+// hand the device as many requests as it has room for, in the
+// order the I/O scheduler picks, merging each run of adjacent
+// blocks going the same way into one request.
+// caller must hold vdisk_lock.
+static void
+virtio_disk_dispatch(void)
+{
+  struct buf *b;
+  int n;
+
+  while(disk.nfree >= (disk.indirect ? 1 : 3) &&
+        (b = iosched_next(disk.indirect ? MAXMERGE : 1, &n)) != 0)
+    virtio_disk_start(b, n);
+}
+
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  acquire(&disk.vdisk_lock);
+
+  b->iodone = 0;
+  b->disk = 1;
+  b->diskwrite = write;
+  iosched_add(b);
+  virtio_disk_dispatch();
 
   // Wait for virtio_disk_intr() to say request has finished.
   while(b->disk == 1) {
     sleep(b, &disk.vdisk_lock);
   }
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+  release(&disk.vdisk_lock);
+}
+
+// queue a read or write of b, and return at once.
+// virtio_disk_intr() calls b->iodone(b) when it has finished,
+// if set; otherwise wait for it with virtio_disk_wait().
+void
+virtio_disk_submit(struct buf *b, int write)
+{
+  acquire(&disk.vdisk_lock);
+  b->disk = 1;
+  b->diskwrite = write;
+  iosched_add(b);
+  if(disk.plugged == 0)
+    virtio_disk_dispatch();
+  release(&disk.vdisk_lock);
+}
+
+// wait for the request virtio_disk_submit() queued for b.
+void
+virtio_disk_wait(struct buf *b)
+{
+  acquire(&disk.vdisk_lock);
+  virtio_disk_dispatch();
+  while(b->disk == 1) {
+    sleep(b, &disk.vdisk_lock);
+  }
+  release(&disk.vdisk_lock);
+}
+
+// hold back requests from virtio_disk_submit() until the
+// matching virtio_disk_unplug(), to merge adjacent ones.
+void
+virtio_disk_plug(void)
+{
+  acquire(&disk.vdisk_lock);
+  disk.plugged++;
+  release(&disk.vdisk_lock);
+}
 
+void
+virtio_disk_unplug(void)
+{
+  acquire(&disk.vdisk_lock);
+  if(--disk.plugged == 0)
+    virtio_disk_dispatch();
   release(&disk.vdisk_lock);
 }
 
 void
 virtio_disk_intr()
 {
+  struct buf *b, *nb, *done = 0;
+
   acquire(&disk.vdisk_lock);
 
   // the device won't raise another interrupt until we tell it
@@ -297,6 +422,7 @@ virtio_disk_intr()
   // the device increments disk.used->idx when it
   // adds an entry to the used ring.
 
+again:
   while(disk.used_idx != disk.used->idx){
     __sync_synchronize();
     int id = disk.used->ring[disk.used_idx % NUM].id;
@@ -304,12 +430,43 @@ virtio_disk_intr()
     if(disk.info[id].status != 0)
       panic("virtio_disk_intr status");
 
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
+    b = disk.info[id].b;
+    disk.info[id].b = 0;
+    free_chain(id);
+    for(; b; b = nb){
+      nb = b->qnext;
+      b->disk = 0;   // disk is done with buf
+      iosched_done(b);
+      if(b->iodone){
+        b->qnext = done;
+        done = b;
+      } else {
+        wakeup(b);
+      }
+    }
 
     disk.used_idx += 1;
   }
 
+  // descriptors have come free: start the next requests.
+  virtio_disk_dispatch();
+
+  if(disk.event_idx){
+    // ask for an interrupt at the next completion only, then
+    // pick up any that came in before the device could see that.
+    disk.avail->used_event = disk.used_idx;
+    __sync_synchronize();
+    if(disk.used_idx != disk.used->idx)
+      goto again;
+  }
+
   release(&disk.vdisk_lock);
+
+  // run completion callbacks without holding the lock.
+  for(b = done; b; b = nb){
+    void (*fn)(struct buf*) = b->iodone;
+    nb = b->qnext;
+    b->iodone = 0;
+    fn(b);
+  }
 }
@@ -3,14 +3,138 @@
 #include "kernel/fcntl.h"
 #include "user/user.h"
 
+// stats: print the kernel's statistics.
+// stats cmd [arg ...]: run cmd, and print how much each counter
+// changed meanwhile. Counter lines are a name followed by
+// numbers; lines starting with # name the columns.
+
 #define SZ 4096
 char buf[SZ];
+char before[SZ];
+
+// Split the n bytes of snapshot s into lines, in place.
+// Returns the number of lines.
+int
+splitlines(char *s, int n)
+{
+  int nl = 0;
+
+  for(int i = 0; i < n; i++){
+    if(s[i] == '\n'){
+      s[i] = 0;
+      nl++;
+    }
+  }
+  if(n > 0 && s[n-1] != 0){
+    s[n] = 0;
+    nl++;
+  }
+  return nl;
+}
+
+// Length of the name at the start of line l.
+int
+namelen(char *l)
+{
+  char *p = strchr(l, ' ');
+  return p ? p - l : strlen(l);
+}
 
+// Is every field after the name a number?
 int
-main(void)
+numeric(char *l)
+{
+  char *p = l + namelen(l);
+
+  if(*p == 0)
+    return 0;
+  for(; *p; p++)
+    if(*p != ' ' && (*p < '0' || *p > '9'))
+      return 0;
+  return 1;
+}
+
+// Find the line named like l among the nl lines of s.
+char*
+lookup(char *s, int nl, char *l)
+{
+  int len = namelen(l);
+
+  for(; nl > 0; nl--, s += strlen(s) + 1)
+    if(namelen(s) == len && memcmp(s, l, len) == 0)
+      return s;
+  return 0;
+}
+
+// Print line l of the second snapshot, less its values in the
+// line named the same in the first.
+void
+printdiff(char *l, char *old)
+{
+  char *p = l + namelen(l);
+  char *q = old ? old + namelen(old) : 0;
+
+  write(1, l, namelen(l));
+  while(*p){
+    while(*p == ' ')
+      p++;
+    if(q)
+      while(*q == ' ')
+        q++;
+    int v = atoi(p);
+    if(q && *q){
+      v -= atoi(q);
+      while(*q && *q != ' ')
+        q++;
+    }
+    printf(" %d", v);
+    while(*p && *p != ' ')
+      p++;
+  }
+  printf("\n");
+}
+
+void
+diff(char *argv[])
+{
+  int n0, n1, nl0, nl1, pid;
+  char *l;
+
+  n0 = statistics(before, SZ - 1);
+  pid = fork();
+  if(pid < 0){
+    fprintf(2, "stats: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    exec(argv[1], argv + 1);
+    fprintf(2, "stats: exec %s failed\n", argv[1]);
+    exit(1);
+  }
+  wait(0);
+  n1 = statistics(buf, SZ - 1);
+
+  nl0 = splitlines(before, n0);
+  nl1 = splitlines(buf, n1);
+  l = buf;
+  for(int i = 0; i < nl1; i++, l += strlen(l) + 1){
+    if(l[0] == '#')
+      printf("%s\n", l);
+    else if(numeric(l))
+      printdiff(l, lookup(before, nl0, l));
+  }
+}
+
+int
+main(int argc, char *argv[])
 {
   int i, n;
-  
+
+  if(argc > 1){
+    diff(argv);
+    exit(0);
+  }
+
   while (1) {
     n = statistics(buf, SZ);
     for (i = 0; i < n; i++) {
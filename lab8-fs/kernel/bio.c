@@ -53,7 +53,8 @@ binit(void)
 }
 
 // Look through buffer cache for block on device dev.
-// If not found, allocate a buffer.
+// If not found, allocate a buffer, waiting for one to be
+// released if they are all in use.
 // In either case, return locked buffer.
 static struct buf*
 bget(uint dev, uint blockno)
@@ -62,6 +63,7 @@ bget(uint dev, uint blockno)
 
   acquire(&bcache.lock);
 
+again:
   // Is the block already cached?
   for(b = bcache.head.next; b != &bcache.head; b = b->next){
     if(b->dev == dev && b->blockno == blockno){
@@ -85,7 +87,8 @@ bget(uint dev, uint blockno)
       return b;
     }
   }
-  panic("bget: no buffers");
+  sleep(&bcache, &bcache.lock);
+  goto again;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -102,6 +105,18 @@ bread(uint dev, uint blockno)
   return b;
 }
 
+// Return a locked buf for the indicated block, without reading
+// it from disk, for a caller that overwrites all of it.
+struct buf*
+bgetblk(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno);
+  b->valid = 1;
+  return b;
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -111,6 +126,17 @@ bwrite(struct buf *b)
   virtio_disk_rw(b, 1);
 }
 
+// Write the n locked bufs of adjacent blocks bufs[0], bufs[1],
+// ... to disk with a single request.
+void
+bwritev(struct buf **bufs, int n)
+{
+  for(int i = 0; i < n; i++)
+    if(!holdingsleep(&bufs[i]->lock))
+      panic("bwritev");
+  virtio_disk_rwv(bufs, n, 1);
+}
+
 // Release a locked buffer.
 // Move to the head of the most-recently-used list.
 void
@@ -131,6 +157,7 @@ brelse(struct buf *b)
     b->prev = &bcache.head;
     bcache.head.next->prev = b;
     bcache.head.next = b;
+    wakeup(&bcache);
   }
   
   release(&bcache.lock);
@@ -146,7 +173,8 @@ bpin(struct buf *b) {
 void
 bunpin(struct buf *b) {
   acquire(&bcache.lock);
-  b->refcnt--;
+  if(--b->refcnt == 0)
+    wakeup(&bcache);
   release(&bcache.lock);
 }
 
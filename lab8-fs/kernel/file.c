@@ -153,6 +153,13 @@ filewrite(struct file *f, uint64 addr, int n)
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
     int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+    if(ORDERED && f->ip->type == T_FILE){
+      // the data blocks bypass the log. how many blocks map them
+      // depends on how fragmented the free space is, so writei()
+      // stops short before it could log more than MAXOPBLOCKS,
+      // and the rest goes in the next transaction.
+      max = NINDIRECT * BSIZE;
+    }
     int i = 0;
     while(i < n){
       int n1 = n - i;
@@ -166,7 +173,7 @@ filewrite(struct file *f, uint64 addr, int n)
       iunlock(f->ip);
       end_op();
 
-      if(r != n1){
+      if(r <= 0){
         // error from writei
         break;
       }
@@ -31,6 +31,7 @@ struct inode {
   short nlink;
   uint size;
   uint addrs[NDIRECT+2];
+  struct extent ext;  // last extent bmap() used, if len > 0
 };
 
 // map major device number to device functions.
@@ -26,6 +26,11 @@
 // only one device
 struct superblock sb; 
 
+static void bcountinit(int dev);
+static void imapinit(int dev);
+static void dcinit(void);
+static void dcpurge(uint dev, uint inum);
+
 // Read the super block.
 static void
 readsb(int dev, struct superblock *sb)
@@ -44,6 +49,8 @@ fsinit(int dev) {
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
   initlog(dev, &sb);
+  bcountinit(dev);
+  imapinit(dev);
 }
 
 // Zero a block.
@@ -59,32 +66,119 @@ bzero(int dev, int bno)
 }
 
 // Blocks.
+//
+// The allocator keeps a count of the free blocks under each
+// bitmap block, so it can skip full ones without reading them,
+// and a rotor: where the last allocation left off. It allocates
+// after a goal, such as the block just past the end of the file,
+// so that a file's blocks follow one another on disk, and it
+// hands out runs of adjacent blocks at once.
 
-// Allocate a zeroed disk block.
-static uint
-balloc(uint dev)
+#define NBMAP (FSSIZE/BPB + 1)  // bitmap blocks
+
+struct {
+  struct spinlock lock;
+  int nbmap;
+  int nfree[NBMAP];  // free blocks under each bitmap block
+  uint rotor;        // just after the last block allocated
+} bcount;
+
+// Count the free blocks, after recovery.
+static void
+bcountinit(int dev)
 {
-  int b, bi, m;
   struct buf *bp;
+  int b, bi;
 
-  bp = 0;
+  initlock(&bcount.lock, "bcount");
+  bcount.nbmap = (sb.size + BPB - 1) / BPB;
+  if(bcount.nbmap > NBMAP)
+    panic("bcountinit: too many bitmap blocks");
   for(b = 0; b < sb.size; b += BPB){
     bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
-      }
+    for(bi = 0; bi < BPB && b + bi < sb.size; bi++)
+      if((bp->data[bi/8] & (1 << (bi % 8))) == 0)
+        bcount.nfree[b/BPB]++;
+    brelse(bp);
+  }
+}
+
+// Is block b, under bitmap block bp, free for use as ordered
+// data (if data > 0) or otherwise?
+static int
+bisfree(struct buf *bp, uint b, int data)
+{
+  int bi = b % BPB;
+
+  if(bp->data[bi/8] & (1 << (bi % 8)))
+    return 0;
+  // writei() writes ordered data home before the transaction
+  // commits, so it must not be a block that the log might yet
+  // install over it, or that an uncommitted transaction frees.
+  return !(data > 0 && log_holds(b));
+}
+
+// Allocate up to n adjacent disk blocks, as soon after goal as
+// there is a free one, or after the rotor if goal is 0. Returns
+// the first, with how many there are, at least 1, in *got.
+// Blocks for metadata (data == 0) come zeroed, through the log.
+// Blocks for ordered data (data == 1) do not: writei() zeroes
+// what it needs to. If every free block is one the log holds,
+// ordered data gets one of those (data == -1), which writei()
+// then logs like metadata (see log_holds()).
+static uint
+ballocn(uint dev, int data, uint goal, int n, int *got)
+{
+  int i, bmi, k;
+  uint b, end;
+  struct buf *bp;
+
+  if(goal == 0 || goal >= sb.size)
+    goal = bcount.rotor;
+  // goal's bitmap block is visited twice: from goal on, and at
+  // the end, from its start.
+  for(i = 0; i <= bcount.nbmap; i++){
+    bmi = (goal/BPB + i) % bcount.nbmap;
+    acquire(&bcount.lock);
+    k = bcount.nfree[bmi];
+    release(&bcount.lock);
+    if(k == 0)
+      continue;
+    bp = bread(dev, sb.bmapstart + bmi);
+    end = min((bmi + 1) * BPB, sb.size);
+    for(b = i == 0 ? goal : bmi * BPB; b < end; b++){
+      if(!bisfree(bp, b, data))
+        continue;
+      for(k = 0; k < n && b + k < end && bisfree(bp, b + k, data); k++)
+        bp->data[(b + k) % BPB / 8] |= 1 << ((b + k) % 8);  // Mark block in use.
+      log_write(bp);
+      brelse(bp);
+      acquire(&bcount.lock);
+      bcount.nfree[bmi] -= k;
+      bcount.rotor = b + k;
+      release(&bcount.lock);
+      if(!data)
+        for(i = 0; i < k; i++)
+          bzero(dev, b + i);
+      *got = k;
+      return b;
     }
     brelse(bp);
   }
+  if(data > 0)
+    return ballocn(dev, -1, goal, 1, got);
   panic("balloc: out of blocks");
 }
 
+// Allocate a disk block, zeroed unless it's for ordered data.
+static uint
+balloc(uint dev, int data)
+{
+  int got;
+
+  return ballocn(dev, data, 0, 1, &got);
+}
+
 // Free a disk block.
 static void
 bfree(int dev, uint b)
@@ -100,6 +194,22 @@ bfree(int dev, uint b)
   bp->data[bi/8] &= ~m;
   log_write(bp);
   brelse(bp);
+  log_free(b);
+  acquire(&bcount.lock);
+  bcount.nfree[b/BPB]++;
+  release(&bcount.lock);
+}
+
+// Extents.
+
+// Start an empty extent tree in the addrs[] of an inode.
+static void
+extinit(uint *addrs)
+{
+  struct exthdr *h = (struct exthdr*)addrs;
+
+  memset(addrs, 0, sizeof(uint)*(NDIRECT+2));
+  h->magic = EXTMAGIC;
 }
 
 // Inodes.
@@ -126,6 +236,7 @@ bfree(int dev, uint b)
 // * Allocation: an inode is allocated if its type (on disk)
 //   is non-zero. ialloc() allocates, and iput() frees if
 //   the reference and link counts have fallen to zero.
+//   imap keeps a bitmap of the allocated inodes in memory.
 //
 // * Referencing in table: an entry in the inode table
 //   is free if ip->ref is zero. Otherwise ip->ref tracks
@@ -190,33 +301,100 @@ iinit()
   for(i = 0; i < NINODE; i++) {
     initsleeplock(&itable.inode[i].lock, "inode");
   }
+  dcinit();
 }
 
-static struct inode* iget(uint dev, uint inum);
+// Which inodes are allocated, as of the latest transaction, so
+// that ialloc() needn't read inode blocks to find a free one.
+// mkfs has no inode bitmap on disk; imapinit() builds this from
+// the inodes at boot.
+struct {
+  struct spinlock lock;
+  uchar used[BSIZE];  // bit per inode
+  uint hint;          // just after the last inode allocated
+} imap;
 
-// Allocate an inode on device dev.
-// Mark it as allocated by  giving it type type.
-// Returns an unlocked but allocated and referenced inode.
-struct inode*
-ialloc(uint dev, short type)
+static void
+imapinit(int dev)
 {
-  int inum;
   struct buf *bp;
   struct dinode *dip;
+  uint inum;
 
+  initlock(&imap.lock, "imap");
+  if(sb.ninodes > BPB)
+    panic("imapinit: too many inodes");
+  imap.used[0] = 1;  // there is no inode 0
   for(inum = 1; inum < sb.ninodes; inum++){
     bp = bread(dev, IBLOCK(inum, sb));
     dip = (struct dinode*)bp->data + inum%IPB;
-    if(dip->type == 0){  // a free inode
-      memset(dip, 0, sizeof(*dip));
-      dip->type = type;
-      log_write(bp);   // mark it allocated on the disk
-      brelse(bp);
-      return iget(dev, inum);
-    }
+    if(dip->type != 0)
+      imap.used[inum/8] |= 1 << (inum % 8);
     brelse(bp);
   }
-  panic("ialloc: no inodes");
+}
+
+// Find a free inode, as soon after near as there is one, or
+// after the last one allocated if near is 0, and mark it in use.
+static uint
+imapalloc(uint near)
+{
+  uint i, inum;
+
+  acquire(&imap.lock);
+  if(near == 0)
+    near = imap.hint;
+  for(i = 0; i < sb.ninodes; i++){
+    inum = (near + i) % sb.ninodes;
+    if(inum % 8 == 0 && imap.used[inum/8] == 0xff &&
+       inum + 8 <= sb.ninodes && i + 8 <= sb.ninodes){
+      i += 7;  // skip a full byte
+      continue;
+    }
+    if((imap.used[inum/8] & (1 << (inum % 8))) == 0){
+      imap.used[inum/8] |= 1 << (inum % 8);
+      imap.hint = inum + 1;
+      release(&imap.lock);
+      return inum;
+    }
+  }
+  release(&imap.lock);
+  return 0;
+}
+
+static void
+imapfree(uint inum)
+{
+  acquire(&imap.lock);
+  imap.used[inum/8] &= ~(1 << (inum % 8));
+  release(&imap.lock);
+}
+
+static struct inode* iget(uint dev, uint inum);
+
+// Allocate an inode on device dev, near inode near (such as
+// the directory it goes in) for locality, if near isn't 0.
+// Mark it as allocated by  giving it type type.
+// Returns an unlocked but allocated and referenced inode.
+struct inode*
+ialloc(uint dev, short type, uint near)
+{
+  uint inum;
+  struct buf *bp;
+  struct dinode *dip;
+
+  if((inum = imapalloc(near)) == 0)
+    panic("ialloc: no inodes");
+  bp = bread(dev, IBLOCK(inum, sb));
+  dip = (struct dinode*)bp->data + inum%IPB;
+  if(dip->type != 0)
+    panic("ialloc: inode in use");
+  memset(dip, 0, sizeof(*dip));
+  dip->type = type;
+  extinit(dip->addrs);
+  log_write(bp);   // mark it allocated on the disk
+  brelse(bp);
+  return iget(dev, inum);
 }
 
 // Copy a modified in-memory inode to disk.
@@ -310,6 +488,7 @@ ilock(struct inode *ip)
     ip->nlink = dip->nlink;
     ip->size = dip->size;
     memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
+    ip->ext.len = 0;
     brelse(bp);
     ip->valid = 1;
     if(ip->type == 0)
@@ -349,8 +528,11 @@ iput(struct inode *ip)
     release(&itable.lock);
 
     itrunc(ip);
+    if(ip->type == T_DIR)
+      dcpurge(ip->dev, ip->inum);
     ip->type = 0;
     iupdate(ip);
+    imapfree(ip->inum);
     ip->valid = 0;
 
     releasesleep(&ip->lock);
@@ -370,24 +552,263 @@ iunlockput(struct inode *ip)
   iput(ip);
 }
 
+// Does ip's content bypass the log? In ordered-data mode the
+// data of a regular file goes straight to its home location,
+// before the transaction that allocates it or grows the file
+// commits. Directories and symlinks are logged like other
+// metadata.
+static int
+ordered(struct inode *ip)
+{
+  return ORDERED && ip->type == T_FILE;
+}
+
 // Inode content
 //
 // The content (data) associated with each inode is stored
-// in blocks on the disk. The first NDIRECT block numbers
+// in blocks on the disk. An inode that ialloc() made lists them
+// as extents, in a tree rooted in ip->addrs[] (see fs.h).
+// Files only grow at the end, so extents are only ever added
+// after the last one, and the tree grows on its right.
+//
+// In an inode from mkfs, the first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// listed in block ip->addrs[NDIRECT], and the NDOUBLE_INDIRECT
+// after that in the blocks that block ip->addrs[NDIRECT+1] lists.
+
+static struct exthdr*
+extroot(struct inode *ip)
+{
+  return (struct exthdr*)ip->addrs;
+}
+
+// How many entries fit in node h?
+static int
+extmax(struct inode *ip, struct exthdr *h)
+{
+  int sz = h == extroot(ip) ? EXTROOT : EXTNODE;
+
+  if(h->depth == 0)
+    return sz / sizeof(struct extent);
+  return sz / sizeof(struct extidx);
+}
+
+static struct extent*
+extents(struct exthdr *h)
+{
+  return (struct extent*)(h + 1);
+}
+
+static struct extidx*
+extidx(struct exthdr *h)
+{
+  return (struct extidx*)(h + 1);
+}
+
+// Find the disk block of ip's block bn in its extent tree.
+// Returns 0 if bn is past the last extent.
+static uint
+extmap(struct inode *ip, uint bn)
+{
+  struct exthdr *h = extroot(ip);
+  struct buf *bp = 0, *nbp;
+  struct extent *e;
+  uint addr = 0;
+  int i;
+
+  // sequential access mostly stays in the last extent used.
+  if(bn - ip->ext.lblk < ip->ext.len)
+    return ip->ext.start + bn - ip->ext.lblk;
+
+  while(h->depth > 0){
+    for(i = h->n - 1; i > 0 && extidx(h)[i].lblk > bn; i--)
+      ;
+    nbp = bread(ip->dev, extidx(h)[i].block);
+    if(bp)
+      brelse(bp);
+    bp = nbp;
+    h = (struct exthdr*)bp->data;
+  }
+  for(i = h->n - 1; i >= 0 && extents(h)[i].lblk > bn; i--)
+    ;
+  if(i >= 0){
+    e = &extents(h)[i];
+    if(bn - e->lblk < e->len){
+      ip->ext = *e;
+      addr = e->start + bn - e->lblk;
+    }
+  }
+  if(bp)
+    brelse(bp);
+  return addr;
+}
+
+// Would cost more blocks in the log take the running FS op past
+// the MAXOPBLOCKS begin_op() reserved for it? Only ordered data
+// asks: its writes are sized by the data blocks, which bypass the
+// log, so filewrite() can't know the blocks that map them. It
+// goes on with what writei() didn't write in the next op.
+static int
+overbudget(struct inode *ip, int cost)
+{
+  return ordered(ip) && myproc()->opblocks + cost > MAXOPBLOCKS;
+}
+
+// Allocate blocks for ip's block bn, which must be just past
+// its last extent, and for up to n-1 blocks after it, as close
+// behind the last extent as can be. Add them to the tree: to the
+// last extent if they follow on from it, else as a new one.
+// Returns bn's disk block, or 0 if that might overrun the op's
+// share of the log.
+static uint
+extappend(struct inode *ip, uint bn, int n)
+{
+  struct exthdr *h[EXTMAXDEPTH+2];  // the tree's right edge, root first
+  struct buf *bp[EXTMAXDEPTH+2];
+  struct extent *e;
+  uint addr, nb;
+  int top, k, i, got, cost;
+
+  // walk down the right edge of the tree.
+  h[0] = extroot(ip);
+  bp[0] = 0;
+  for(top = 0; h[top]->depth > 0; top++){
+    bp[top+1] = bread(ip->dev, extidx(h[top])[h[top]->n - 1].block);
+    h[top+1] = (struct exthdr*)bp[top+1]->data;
+  }
+  e = h[top]->n > 0 ? &extents(h[top])[h[top]->n - 1] : 0;
+  if(bn != (e ? e->lblk + e->len : 0))
+    panic("extappend");
+
+  // the most this can log: the bitmap block for the run, the
+  // i-node, a block of data if ballocn() has only blocks the log
+  // holds, and the leaf if it has room. else two blocks (the
+  // node and its bitmap block) for each new node, and the index
+  // block the new branch hangs off. at most 10, but 11 for a full
+  // tree of depth 2 that grows to depth 3, which takes more
+  // extents than this disk has blocks.
+  cost = 3;
+  if(h[top]->n < extmax(ip, h[top])){
+    cost += top > 0;
+  } else {
+    for(k = top - 1; k >= 0 && h[k]->n == extmax(ip, h[k]); k--)
+      ;
+    cost += k < 0 ? 2 * (top + 2) : 2 * (top - k) + (k > 0);
+  }
+  if(overbudget(ip, cost)){
+    addr = 0;
+    goto done;
+  }
+
+  addr = ballocn(ip->dev, ordered(ip), e ? e->start + e->len : 0, n, &got);
+  if(e && e->start + e->len == addr){
+    e->len += got;
+    goto out;
+  }
+
+  if(h[top]->n == extmax(ip, h[top])){
+    // the leaf is full: find the lowest node on the edge with
+    // room for another index entry.
+    for(k = top - 1; k >= 0 && h[k]->n == extmax(ip, h[k]); k--)
+      ;
+    if(k < 0){
+      // all full: move the root's entries down into a new
+      // block, and make the root one level taller, pointing at it.
+      if(h[0]->depth == EXTMAXDEPTH)
+        panic("extappend: tree too deep");
+      nb = balloc(ip->dev, 0);
+      for(i = top; i > 0; i--){
+        h[i+1] = h[i];
+        bp[i+1] = bp[i];
+      }
+      bp[1] = bread(ip->dev, nb);
+      h[1] = (struct exthdr*)bp[1]->data;
+      memmove(h[1], h[0], sizeof(struct exthdr) + EXTROOT);
+      log_write(bp[1]);
+      h[0]->depth++;
+      h[0]->n = 1;
+      extidx(h[0])[0].lblk = 0;
+      extidx(h[0])[0].block = nb;
+      top++;
+      k = 0;
+    }
+    // hang a new branch off it, down to a new, empty leaf.
+    for(; k < top; k++){
+      nb = balloc(ip->dev, 0);
+      extidx(h[k])[h[k]->n].lblk = bn;
+      extidx(h[k])[h[k]->n].block = nb;
+      h[k]->n++;
+      if(bp[k])
+        log_write(bp[k]);
+      brelse(bp[k+1]);
+      bp[k+1] = bread(ip->dev, nb);
+      h[k+1] = (struct exthdr*)bp[k+1]->data;
+      h[k+1]->magic = EXTMAGIC;
+      h[k+1]->depth = h[k]->depth - 1;
+    }
+  }
+  e = &extents(h[top])[h[top]->n++];
+  e->lblk = bn;
+  e->start = addr;
+  e->len = got;
+
+out:
+  ip->ext = *e;
+  if(bp[top])
+    log_write(bp[top]);
+done:
+  for(i = 1; i <= top; i++)
+    brelse(bp[i]);
+  return addr;
+}
+
+// Free the blocks that extent tree node h maps, and those
+// holding the nodes below it.
+static void
+extfree(struct inode *ip, struct exthdr *h)
+{
+  struct buf *bp;
+
+  for(int i = 0; i < h->n; i++){
+    if(h->depth == 0){
+      for(uint b = 0; b < extents(h)[i].len; b++)
+        bfree(ip->dev, extents(h)[i].start + b);
+    } else {
+      bp = bread(ip->dev, extidx(h)[i].block);
+      extfree(ip, (struct exthdr*)bp->data);
+      brelse(bp);
+      bfree(ip->dev, extidx(h)[i].block);
+    }
+  }
+}
 
 // Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
+// If there is no such block, bmap allocates one; in an extent
+// inode, along with blocks for up to n-1 blocks after it, for a
+// caller about to write that many. For ordered data, returns 0
+// instead if that might overrun the op's share of the log.
 static uint
-bmap(struct inode *ip, uint bn)
+bmap(struct inode *ip, uint bn, int n)
 {
   uint addr, *a;
   struct buf *bp;
 
+  if(extroot(ip)->magic == EXTMAGIC){
+    if((addr = extmap(ip, bn)) == 0)
+      addr = extappend(ip, bn, n);
+    return addr;
+  }
+
+  // without extents a file has no holes, so a block past its end
+  // is new. mapping it can log its bitmap block, the i-node, two
+  // new index blocks with their bitmap blocks, and the block
+  // itself, as in extappend().
+  if(bn >= (ip->size + BSIZE - 1) / BSIZE && overbudget(ip, 7))
+    return 0;
+
   if(bn < NDIRECT){
     if((addr = ip->addrs[bn]) == 0)
-      ip->addrs[bn] = addr = balloc(ip->dev);
+      ip->addrs[bn] = addr = balloc(ip->dev, ordered(ip));
     return addr;
   }
   bn -= NDIRECT;
@@ -395,11 +816,11 @@ bmap(struct inode *ip, uint bn)
   if(bn < NINDIRECT){
     // Load indirect block, allocating if necessary.
     if((addr = ip->addrs[NDIRECT]) == 0)
-      ip->addrs[NDIRECT] = addr = balloc(ip->dev);
+      ip->addrs[NDIRECT] = addr = balloc(ip->dev, 0);
     bp = bread(ip->dev, addr);
     a = (uint*)bp->data;
     if((addr = a[bn]) == 0){
-      a[bn] = addr = balloc(ip->dev);
+      a[bn] = addr = balloc(ip->dev, ordered(ip));
       log_write(bp);
     }
     brelse(bp);
@@ -413,7 +834,7 @@ bmap(struct inode *ip, uint bn)
 
     // get the root, at depth 0
     if ((addr = ip->addrs[NDIRECT+1]) == 0) {
-      addr = ip->addrs[NDIRECT+1] = balloc(ip->dev);
+      addr = ip->addrs[NDIRECT+1] = balloc(ip->dev, 0);
     }
     bp = bread(ip->dev, addr);
     a = (uint *)bp->data;
@@ -421,7 +842,7 @@ bmap(struct inode *ip, uint bn)
 
     // get the directory, at depth 1
     if ((addr = a[bn / NINDIRECT]) == 0) {
-      addr = a[bn / NINDIRECT] = balloc(ip->dev);
+      addr = a[bn / NINDIRECT] = balloc(ip->dev, 0);
       log_write(bp);
     }
     bp = bread(ip->dev, addr);
@@ -430,14 +851,12 @@ bmap(struct inode *ip, uint bn)
 
     // get to data page, at depth 2
     if ((addr = a[bn % NINDIRECT]) == 0) {
-      addr = a[bn % NINDIRECT] = balloc(ip->dev);
+      addr = a[bn % NINDIRECT] = balloc(ip->dev, ordered(ip));
       log_write(bp);
     }
-    bp = bread(ip->dev, addr);
 
     brelse(f1);
     brelse(f2);
-    brelse(bp);
     return addr;
   }
 
@@ -453,6 +872,11 @@ itrunc(struct inode *ip)
   struct buf *bp;
   uint *a;
 
+  if(extroot(ip)->magic == EXTMAGIC){
+    extfree(ip, extroot(ip));
+    goto done;
+  }
+
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
       bfree(ip->dev, ip->addrs[i]);
@@ -472,6 +896,10 @@ itrunc(struct inode *ip)
     ip->addrs[NDIRECT] = 0;
   }
 
+done:
+  // from now on, an inode from mkfs uses extents too.
+  extinit(ip->addrs);
+  ip->ext.len = 0;
   ip->size = 0;
   iupdate(ip);
 }
@@ -504,7 +932,7 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
     n = ip->size - off;
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
+    bp = bread(ip->dev, bmap(ip, off/BSIZE, 1));
     m = min(n - tot, BSIZE - off%BSIZE);
     if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
       brelse(bp);
@@ -516,6 +944,16 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
   return tot;
 }
 
+// Write the n bufs of adjacent ordered data blocks in run
+// home with a single disk request, and release them.
+static void
+writerun(struct buf **run, int n)
+{
+  bwritev(run, n);
+  for(int i = 0; i < n; i++)
+    brelse(run[i]);
+}
+
 // Write data to inode.
 // Caller must hold ip->lock.
 // If user_src==1, then src is a user virtual address;
@@ -526,8 +964,9 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 int
 writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 {
-  uint tot, m;
-  struct buf *bp;
+  uint tot, m, bn;
+  struct buf *bp, *run[NRUN];
+  int nrun = 0, held;
 
   if(off > ip->size || off + n < off)
     return -1;
@@ -535,15 +974,51 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
     return -1;
 
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
+    bn = bmap(ip, off/BSIZE, (off + n - tot - 1)/BSIZE - off/BSIZE + 1);
+    if(bn == 0)  // the rest is for the next op, see filewrite()
+      break;
     m = min(n - tot, BSIZE - off%BSIZE);
+    if(!ordered(ip)){
+      bp = bread(ip->dev, bn);
+      if(either_copyin(bp->data + (off % BSIZE), user_src, src, m) == -1) {
+        brelse(bp);
+        break;
+      }
+      log_write(bp);
+      brelse(bp);
+      continue;
+    }
+
+    // ordered data: write runs of adjacent blocks home with
+    // one disk request each. a block past the end of the file
+    // holds nothing yet, so don't read it. a block the log holds
+    // (see ballocn()) goes through the log instead.
+    held = log_holds(bn);
+    if(held && tot > 0 && overbudget(ip, 1))
+      break;
+    if(nrun > 0 && (nrun == NRUN || run[nrun-1]->blockno + 1 != bn)){
+      writerun(run, nrun);
+      nrun = 0;
+    }
+    if(off - off%BSIZE >= ip->size){
+      bp = bgetblk(ip->dev, bn);
+      memset(bp->data, 0, BSIZE);
+    } else {
+      bp = bread(ip->dev, bn);
+    }
     if(either_copyin(bp->data + (off % BSIZE), user_src, src, m) == -1) {
       brelse(bp);
       break;
     }
-    log_write(bp);
-    brelse(bp);
+    if(held){
+      log_write(bp);
+      brelse(bp);
+      continue;
+    }
+    run[nrun++] = bp;
   }
+  if(nrun > 0)
+    writerun(run, nrun);
 
   if(off > ip->size)
     ip->size = off;
@@ -564,17 +1039,489 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+// Indexed directories (see fs.h). Names are placed by their
+// hash: a lookup reads the first block, perhaps an index block,
+// and the one leaf the name can be in. A leaf that fills up is
+// split in two by hash, and a full index block too. Leaves are
+// never merged or freed. A linear directory is indexed once its
+// first block is full.
+
+// FNV-1a hash of a name.
+static uint
+dirhash(char *name)
+{
+  uint h = 2166136261;
+
+  for(int i = 0; i < DIRSIZ && name[i]; i++){
+    h ^= (uchar)name[i];
+    h *= 16777619;
+  }
+  return h;
+}
+
+// Read block b of directory dp.
+static struct buf*
+dirblock(struct inode *dp, uint b)
+{
+  return bread(dp->dev, bmap(dp, b, 1));
+}
+
+// Add an empty block to the end of directory dp.
+// Returns it, and its number in *b.
+static struct buf*
+dirgrow(struct inode *dp, uint *b)
+{
+  struct buf *bp;
+
+  *b = dp->size / BSIZE;
+  bp = dirblock(dp, *b);
+  memset(bp->data, 0, BSIZE);
+  log_write(bp);
+  dp->size += BSIZE;
+  iupdate(dp);
+  return bp;
+}
+
+// The dxhdr in directory dp's first block, bp, or 0 if dp is
+// linear.
+static struct dxhdr*
+dxroot(struct inode *dp, struct buf *bp)
+{
+  struct dxhdr *h = (struct dxhdr*)((struct dirent*)bp->data + 2);
+
+  if(dp->size <= BSIZE || h->inum != 0 || h->magic != DXMAGIC)
+    return 0;
+  return h;
+}
+
+static struct dxentry*
+dxentries(struct dxhdr *h)
+{
+  return (struct dxentry*)(h + 1);
+}
+
+// Index of the entry of h that hash falls under: the last one
+// with a hash no higher.
+static int
+dxsearch(struct dxhdr *h, uint hash)
+{
+  struct dxentry *e = dxentries(h);
+  int lo = 0, hi = h->n - 1, mid;
+
+  while(lo < hi){
+    mid = (lo + hi + 1) / 2;
+    if(e[mid].hash <= hash)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
+}
+
+// Insert an entry into h, which has room, in hash order.
+static void
+dxinsert(struct dxhdr *h, uint hash, uint block)
+{
+  struct dxentry *e = dxentries(h);
+  int i;
+
+  for(i = h->n; i > 0 && e[i-1].hash > hash; i--)
+    e[i] = e[i-1];
+  memset(&e[i], 0, sizeof(e[i]));
+  e[i].hash = hash;
+  e[i].block = block;
+  h->n++;
+}
+
+// Find the leaf for hash in indexed directory dp, whose root is
+// root. Returns its block number, and in *ib the number of the
+// index block that points at it, or 0 if root does.
+static uint
+dxfind(struct inode *dp, struct dxhdr *root, uint hash, uint *ib)
+{
+  uint b = dxentries(root)[dxsearch(root, hash)].block;
+  struct buf *bp;
+  struct dxhdr *h;
+
+  *ib = 0;
+  if(root->levels == 2){
+    *ib = b;
+    bp = dirblock(dp, b);
+    h = (struct dxhdr*)bp->data;
+    b = dxentries(h)[dxsearch(h, hash)].block;
+    brelse(bp);
+  }
+  return b;
+}
+
+// Look for name among the first n dirents of bp, block b of
+// directory dp. If found, set *poff to byte offset of entry.
+static struct inode*
+dirscan(struct inode *dp, struct buf *bp, uint b, int n, char *name, uint *poff)
+{
+  struct dirent *de = (struct dirent*)bp->data;
+
+  for(int i = 0; i < n; i++){
+    if(de[i].inum != 0 && namecmp(name, de[i].name) == 0){
+      if(poff)
+        *poff = b*BSIZE + i*sizeof(struct dirent);
+      return iget(dp->dev, de[i].inum);
+    }
+  }
+  return 0;
+}
+
+// Turn linear directory dp, whose only block is full, into an
+// indexed one: move all but "." and ".." to a leaf, and point
+// the index at it. Returns -1 if dp doesn't look like it can.
+static int
+dxinit(struct inode *dp)
+{
+  struct buf *rb, *lb;
+  struct dirent *de;
+  struct dxhdr *h;
+  uint b;
+
+  rb = dirblock(dp, 0);
+  de = (struct dirent*)rb->data;
+  if(dp->size != BSIZE || namecmp(de[0].name, ".") != 0 ||
+     namecmp(de[1].name, "..") != 0){
+    brelse(rb);
+    return -1;
+  }
+  lb = dirgrow(dp, &b);
+  memmove(lb->data, &de[2], (DPB-2) * sizeof(struct dirent));
+  log_write(lb);
+  brelse(lb);
+
+  memset(&de[2], 0, (DPB-2) * sizeof(struct dirent));
+  h = (struct dxhdr*)&de[2];
+  h->magic = DXMAGIC;
+  h->levels = 1;
+  dxinsert(h, 0, b);
+  log_write(rb);
+  brelse(rb);
+  return 0;
+}
+
+// Is there room in the index of directory dp, whose root is
+// root, for another entry under index block ib (0 for the root
+// itself)? A full root can always move down a level.
+static int
+dxroom(struct inode *dp, struct dxhdr *root, uint ib)
+{
+  struct buf *bp;
+  int r;
+
+  if(ib == 0)
+    return 1;
+  bp = dirblock(dp, ib);
+  r = ((struct dxhdr*)bp->data)->n < DXNODE || root->n < DXROOT;
+  brelse(bp);
+  return r;
+}
+
+// Add an entry for (hash, block) to the index of directory dp,
+// whose first block rb holds root, under index block ib (0 for
+// the root itself). The caller has checked dxroom().
+static void
+dxadd(struct inode *dp, struct buf *rb, struct dxhdr *root, uint ib, uint hash, uint block)
+{
+  struct buf *bp, *nbp;
+  struct dxhdr *h, *nh;
+  uint nb;
+  int half;
+
+  if(ib == 0){
+    if(root->n < DXROOT){
+      dxinsert(root, hash, block);
+      log_write(rb);
+      return;
+    }
+    // move the root's entries down into an index block.
+    nbp = dirgrow(dp, &nb);
+    nh = (struct dxhdr*)nbp->data;
+    nh->magic = DXMAGIC;
+    nh->n = root->n;
+    memmove(dxentries(nh), dxentries(root), root->n * sizeof(struct dxentry));
+    dxinsert(nh, hash, block);
+    log_write(nbp);
+    brelse(nbp);
+    root->n = 0;
+    root->levels = 2;
+    dxinsert(root, 0, nb);
+    log_write(rb);
+    return;
+  }
+
+  bp = dirblock(dp, ib);
+  h = (struct dxhdr*)bp->data;
+  if(h->n < DXNODE){
+    dxinsert(h, hash, block);
+    log_write(bp);
+    brelse(bp);
+    return;
+  }
+  // split the index block, moving its upper half to a new one.
+  nbp = dirgrow(dp, &nb);
+  nh = (struct dxhdr*)nbp->data;
+  nh->magic = DXMAGIC;
+  half = h->n / 2;
+  nh->n = h->n - half;
+  memmove(dxentries(nh), &dxentries(h)[half], nh->n * sizeof(struct dxentry));
+  h->n = half;
+  dxinsert(hash >= dxentries(nh)[0].hash ? nh : h, hash, block);
+  dxinsert(root, dxentries(nh)[0].hash, nb);
+  log_write(bp);
+  log_write(nbp);
+  log_write(rb);
+  brelse(bp);
+  brelse(nbp);
+}
+
+// Split full leaf lb of directory dp by hash,
+// moving the upper part to a new leaf, and index that under ib.
+// Releases lb. Returns -1 if it can't: the index is full, or
+// most names in the leaf hash the same.
+static int
+dxsplit(struct inode *dp, struct buf *rb, struct dxhdr *root, uint ib,
+        struct buf *lb)
+{
+  struct dirent *de = (struct dirent*)lb->data, *nde;
+  struct buf *nbp;
+  uint hash[DPB], sorted[DPB], split, nb;
+  int i, j;
+
+  if(!dxroom(dp, root, ib)){
+    brelse(lb);
+    return -1;
+  }
+  for(i = 0; i < DPB; i++){
+    hash[i] = dirhash(de[i].name);
+    for(j = i; j > 0 && sorted[j-1] > hash[i]; j--)
+      sorted[j] = sorted[j-1];
+    sorted[j] = hash[i];
+  }
+  // split at the middle, or as near as names with the same hash
+  // allow.
+  for(i = DPB/2; i < DPB && sorted[i] == sorted[i-1]; i++)
+    ;
+  if(i == DPB)
+    for(i = DPB/2 - 1; i > 0 && sorted[i] == sorted[i-1]; i--)
+      ;
+  if(i == 0){
+    brelse(lb);
+    return -1;
+  }
+  split = sorted[i];
+
+  nbp = dirgrow(dp, &nb);
+  nde = (struct dirent*)nbp->data;
+  for(i = j = 0; i < DPB; i++){
+    if(hash[i] >= split){
+      nde[j++] = de[i];
+      memset(&de[i], 0, sizeof(de[i]));
+    }
+  }
+  log_write(lb);
+  log_write(nbp);
+  brelse(lb);
+  brelse(nbp);
+  dxadd(dp, rb, root, ib, split, nb);
+  return 0;
+}
+
+// Write a new entry (name, inum) into indexed directory dp,
+// whose first block rb holds root.
+static int
+dxlink(struct inode *dp, struct buf *rb, struct dxhdr *root, char *name, uint inum)
+{
+  struct buf *lb;
+  struct dirent *de;
+  uint leaf, ib;
+
+  for(;;){
+    leaf = dxfind(dp, root, dirhash(name), &ib);
+    lb = dirblock(dp, leaf);
+    de = (struct dirent*)lb->data;
+    for(int i = 0; i < DPB; i++){
+      if(de[i].inum == 0){
+        strncpy(de[i].name, name, DIRSIZ);
+        de[i].inum = inum;
+        log_write(lb);
+        brelse(lb);
+        return 0;
+      }
+    }
+    if(dxsplit(dp, rb, root, ib, lb) < 0)
+      return -1;
+  }
+}
+
+// Directory entry cache.
+//
+// Remembers what dirlookup() found: (directory, name) -> inum,
+// or that there is no such name (inum 0), so namex() can walk
+// through directories it has been through before without
+// locking or reading them. An entry is only added while the
+// directory is locked, and anything that changes a directory's
+// entries locks it and updates the cache: dirlink() adds the
+// new entry, unlink calls dcforget(). There's an entry for a
+// directory only while it is one; iput() purges them when it
+// frees it.
+
+#define NDHASH 31
+
+struct dentry {
+  uint dev;
+  uint parent;        // inum of the directory
+  char name[DIRSIZ];
+  uint inum;          // 0: the directory has no such name
+  struct dentry *next;  // in hash bucket
+  int used;
+};
+
+struct {
+  struct spinlock lock;
+  struct dentry dentry[NDCACHE];
+  struct dentry *bucket[NDHASH];
+  int hand;           // next to reuse
+} dcache;
+
+static void
+dcinit(void)
+{
+  initlock(&dcache.lock, "dcache");
+}
+
+static struct dentry**
+dcbucket(uint dev, uint parent, char *name)
+{
+  return &dcache.bucket[(dirhash(name) ^ parent ^ dev) % NDHASH];
+}
+
+// Find the entry for (parent, name). Caller holds dcache.lock.
+static struct dentry*
+dcfind(uint dev, uint parent, char *name)
+{
+  struct dentry *d;
+
+  for(d = *dcbucket(dev, parent, name); d; d = d->next)
+    if(d->dev == dev && d->parent == parent && namecmp(d->name, name) == 0)
+      return d;
+  return 0;
+}
+
+// Take d out of its bucket. Caller holds dcache.lock.
+static void
+dcunhash(struct dentry *d)
+{
+  struct dentry **pp;
+
+  for(pp = dcbucket(d->dev, d->parent, d->name); *pp != d; pp = &(*pp)->next)
+    ;
+  *pp = d->next;
+  d->used = 0;
+}
+
+// Look name up in directory dp, which needn't be locked. On a
+// hit, return 1, with a referenced inode in *ipp, or 0 if
+// there's no such name.
+static int
+dclookup(struct inode *dp, char *name, struct inode **ipp)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if((d = dcfind(dp->dev, dp->inum, name)) == 0){
+    release(&dcache.lock);
+    return 0;
+  }
+  // take the reference before an unlink can drop the entry
+  // and free the inode.
+  *ipp = d->inum ? iget(d->dev, d->inum) : 0;
+  release(&dcache.lock);
+  return 1;
+}
+
+// Remember that name in directory dp, which is locked, is inum.
+static void
+dcenter(struct inode *dp, char *name, uint inum)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if((d = dcfind(dp->dev, dp->inum, name)) == 0){
+    d = &dcache.dentry[dcache.hand];
+    dcache.hand = (dcache.hand + 1) % NDCACHE;
+    if(d->used)
+      dcunhash(d);
+    d->dev = dp->dev;
+    d->parent = dp->inum;
+    strncpy(d->name, name, DIRSIZ);
+    d->used = 1;
+    d->next = *dcbucket(d->dev, d->parent, d->name);
+    *dcbucket(d->dev, d->parent, d->name) = d;
+  }
+  d->inum = inum;
+  release(&dcache.lock);
+}
+
+// Forget what name in directory dp, which is locked, was.
+void
+dcforget(struct inode *dp, char *name)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if((d = dcfind(dp->dev, dp->inum, name)) != 0)
+    dcunhash(d);
+  release(&dcache.lock);
+}
+
+// Forget all the entries in directory inum, which is going away.
+static void
+dcpurge(uint dev, uint inum)
+{
+  acquire(&dcache.lock);
+  for(int i = 0; i < NDCACHE; i++){
+    struct dentry *d = &dcache.dentry[i];
+    if(d->used && d->dev == dev && d->parent == inum)
+      dcunhash(d);
+  }
+  release(&dcache.lock);
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
 struct inode*
 dirlookup(struct inode *dp, char *name, uint *poff)
 {
-  uint off, inum;
+  uint off, inum, leaf, ib;
   struct dirent de;
+  struct buf *bp;
+  struct dxhdr *root;
+  struct inode *ip;
 
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
+  if(dp->size > BSIZE){
+    bp = dirblock(dp, 0);
+    if((root = dxroot(dp, bp)) != 0){
+      // "." and ".." stay in the first block.
+      if((ip = dirscan(dp, bp, 0, 2, name, poff)) == 0){
+        leaf = dxfind(dp, root, dirhash(name), &ib);
+        brelse(bp);
+        bp = dirblock(dp, leaf);
+        ip = dirscan(dp, bp, leaf, DPB, name, poff);
+      }
+      brelse(bp);
+      return ip;
+    }
+    brelse(bp);
+  }
+
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
       panic("dirlookup read");
@@ -596,9 +1543,11 @@ dirlookup(struct inode *dp, char *name, uint *poff)
 int
 dirlink(struct inode *dp, char *name, uint inum)
 {
-  int off;
+  int off, r;
   struct dirent de;
   struct inode *ip;
+  struct buf *bp;
+  struct dxhdr *root;
 
   // Check that name is not present.
   if((ip = dirlookup(dp, name, 0)) != 0){
@@ -606,6 +1555,18 @@ dirlink(struct inode *dp, char *name, uint inum)
     return -1;
   }
 
+  if(dp->size > BSIZE){
+    bp = dirblock(dp, 0);
+    if((root = dxroot(dp, bp)) != 0){
+      r = dxlink(dp, bp, root, name, inum);
+      brelse(bp);
+      if(r == 0)
+        dcenter(dp, name, inum);
+      return r;
+    }
+    brelse(bp);
+  }
+
   // Look for an empty dirent.
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
@@ -614,10 +1575,15 @@ dirlink(struct inode *dp, char *name, uint inum)
       break;
   }
 
+  // the first block is full: index the directory.
+  if(off == BSIZE && dxinit(dp) == 0)
+    return dirlink(dp, name, inum);
+
   strncpy(de.name, name, DIRSIZ);
   de.inum = inum;
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     panic("dirlink");
+  dcenter(dp, name, inum);
 
   return 0;
 }
@@ -676,6 +1642,15 @@ namex(char *path, int nameiparent, char *name)
     ip = idup(myproc()->cwd);
 
   while((path = skipelem(path, name)) != 0){
+    // an entry in the cache means ip is a directory, and saves
+    // locking it.
+    if(!(nameiparent && *path == '\0') && dclookup(ip, name, &next)){
+      iput(ip);
+      if(next == 0)
+        return 0;
+      ip = next;
+      continue;
+    }
     ilock(ip);
     if(ip->type != T_DIR){
       iunlockput(ip);
@@ -686,11 +1661,11 @@ namex(char *path, int nameiparent, char *name)
       iunlock(ip);
       return ip;
     }
-    if((next = dirlookup(ip, name, 0)) == 0){
-      iunlockput(ip);
-      return 0;
-    }
+    next = dirlookup(ip, name, 0);
+    dcenter(ip, name, next ? next->inum : 0);
     iunlockput(ip);
+    if(next == 0)
+      return 0;
     ip = next;
   }
   if(nameiparent){
@@ -48,6 +48,35 @@ struct dinode {
   uint addrs[NDIRECT+2];   // Data block addresses
 };
 
+// An inode whose addrs[] start with an exthdr holding EXTMAGIC
+// maps its blocks with extents instead: runs of adjacent blocks,
+// kept in a tree whose root is in addrs[]. A node at depth 0
+// holds extents; one above holds index entries, each pointing
+// at a block with the node below. An inode from mkfs, whose
+// addrs[0] is a block number, maps blocks as described above.
+#define EXTMAGIC 0xE47E  // in the high half of addrs[0]: no block number
+
+struct exthdr {
+  uchar n;              // Entries in use
+  uchar depth;          // 0 if they are extents, else index entries
+  ushort magic;         // Must be EXTMAGIC
+};
+
+struct extent {
+  uint lblk;            // First file block it maps
+  uint start;           // Disk block of lblk
+  uint len;             // Number of blocks
+};
+
+struct extidx {
+  uint lblk;            // First file block under it
+  uint block;           // Block containing the node below
+};
+
+#define EXTROOT       (sizeof(uint)*(NDIRECT+2) - sizeof(struct exthdr))
+#define EXTNODE       (BSIZE - sizeof(struct exthdr))
+#define EXTMAXDEPTH   3
+
 // Inodes per block.
 #define IPB           (BSIZE / sizeof(struct dinode))
 
@@ -68,5 +97,38 @@ struct dirent {
   char name[DIRSIZ];
 };
 
+// Dirents per block.
+#define DPB           (BSIZE / sizeof(struct dirent))
+
+// A directory that outgrows its first block is indexed. Its
+// first block keeps "." and "..", followed by a dxhdr and
+// dxentrys sorted by hash. Each dxentry points at a leaf: a
+// block of dirents whose names hash to at least its hash, and
+// less than the next one's. In a big directory, the entries in
+// the first block point instead at index blocks, each holding a
+// dxhdr and more dxentrys, which point at leaves. Both structs
+// are the size of a dirent and start with a zero inum, so that
+// whatever reads a directory as dirents, like ls, skips them.
+#define DXMAGIC 0xD1C7
+
+struct dxhdr {
+  ushort inum;          // Always 0
+  ushort magic;         // Must be DXMAGIC
+  ushort n;             // Entries that follow
+  ushort levels;        // In the first block: 1 if they point at leaves, 2 if at index blocks
+  uint pad[2];
+};
+
+struct dxentry {
+  ushort inum;          // Always 0
+  ushort pad;
+  uint hash;            // Lowest hash of the names under it
+  uint block;           // Directory block it points at
+  uint pad2;
+};
+
+#define DXROOT        (DPB - 3)  // dxentrys in the first block
+#define DXNODE        (DPB - 1)  // dxentrys in an index block
+
 
 #endif // FS_H
@@ -6,50 +6,142 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "proc.h"
 
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
-// calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
+// calls. The log thread closes the running transaction only when
+// there are no FS system calls active in it. Thus there is never
 // any reasoning required about whether a commit might
 // write an uncommitted system call's updates to disk.
 //
 // A system call should call begin_op()/end_op() to mark
 // its start and end. Usually begin_op() just increments
 // the count of in-progress FS system calls and returns.
-// But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// But if it thinks the transaction is close to running out of
+// room, it sleeps until the log thread has taken the transaction.
+// end_op() sleeps until the transaction it joined has
+// committed, so a system call's updates are on disk by the
+// time it returns; except in a relaxed process (see
+// sys_relaxed()), whose updates the log thread commits once
+// they are COMMITDELAY ticks old, or when the transaction is
+// full, or when a process waits for a commit or calls
+// fsync()/sync().
+//
+// Transactions are double-buffered: once the log thread has
+// closed a transaction, it copies the transaction's blocks aside
+// and lets new system calls start on the next one, while it
+// writes the closed one to disk. System calls that finish
+// meanwhile all wait for the next commit together (group commit).
+//
+// The log is a physical re-do log containing disk blocks, used
+// as a circular journal. A commit only appends the transaction
+// to the log. The checkpoint thread copies committed blocks to
+// their home locations later, oldest transaction first, once the
+// log is half full or the log thread runs out of room, and then
+// moves the log's tail past them. Blocks stay pinned in the
+// cache until they are home.
 //
-// The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
-//   block A
-//   block B
-//   block C
-//   ...
+//   log super block: where the oldest transaction not yet
+//     installed starts, and its sequence number
+//   transactions, one after the other, wrapping round to just
+//     after the super block when one doesn't fit at the end:
+//     header block, containing seq and block #s for A, B, C, ...
+//     block A
+//     block B
+//     block C
+//     ...
+// A commit writes the header and the blocks with a single disk
+// request. The header carries a checksum of the whole
+// transaction, so recovery can tell a complete one from a write
+// that a crash cut short. Recovery installs the transactions
+// from the tail on, for as long as the next one in the log, or
+// else just after the super block, has the next sequence number
+// and a good checksum.
 // Log appends are synchronous.
+//
+// In ordered-data mode (ORDERED), the contents of regular files
+// are not logged: writei() writes them to their home locations
+// before end_op(), so before the transaction that points the
+// file at them commits. A block the log might still install
+// is not handed out for such data (see log_holds()), or
+// recovery could overwrite the data with the block's old
+// contents. Nor is a block that a transaction not yet committed
+// frees (see log_free()): after a crash before that commit, the
+// file it came from would hold the new data. When those are the
+// only free blocks, ballocn() hands one out anyway, and writei()
+// logs the data written to it.
 
-// Contents of the header block, used for both the on-disk header block
-// and to keep track in memory of logged block# before commit.
+// Contents of a transaction's header block, used for both the
+// on-disk header block and to keep track in memory of logged
+// block# before commit.
 struct logheader {
   int n;
-  int block[LOGSIZE];
+  uint seq;
+  int block[TXNSIZE];
+  uint checksum;  // of n, seq, block[0..n), and the blocks, on disk only.
+};
+
+// Contents of the log's first block.
+struct logsuper {
+  uint magic;
+  uint tail;      // log offset of the oldest transaction not installed.
+  uint seq;       // its sequence number.
+  uint checksum;  // of the above.
+};
+
+#define LOGMAGIC 0x10c0ffee
+
+// A committed transaction, not yet installed.
+struct txn {
+  uint seq;
+  int pos;        // log offset of its header.
+  int n;
+  int block[TXNSIZE];
 };
 
+#define NTXN (LOGSIZE/2)
+
 struct log {
   struct spinlock lock;
   int start;
   int size;
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int closing;     // log thread is closing the transaction, please wait.
   int dev;
-  struct logheader lh;
+  struct logheader lh;  // the running transaction.
+  uint seq;        // sequence number of the running transaction.
+  uint done;       // last transaction committed.
+  int urgent;      // someone waits for the running transaction.
+  int delaying;    // log thread waits out COMMITDELAY, see log_tick().
+  uint dirtied;    // ticks when the running transaction logged its first block.
+
+  // The committed transactions not yet installed, oldest first
+  // from txns[txtail]. They take up the log from tail to head.
+  struct txn txns[NTXN];
+  int txtail;
+  int ntxn;
+  int tail;        // as the super block has it, or later.
+  int head;        // where the next transaction goes.
+  int needroom;    // log thread waits for the checkpoint thread.
+
+  // Owned by the log thread: the transaction being committed.
+  int writing;     // clh is closed, but not yet committed.
+  struct logheader clh;
+  uchar copy[TXNSIZE][BSIZE]; // its blocks, as of when it closed.
+
+  // Blocks that transaction seq frees, in freed[seq%2]: the
+  // running one, and the one being committed.
+  int nfreed[2];
+  uchar freed[2][FSSIZE/8 + 1];
 };
 struct log log;
 
 static void recover_from_log(void);
-static void commit();
+static void logthread(void);
+static void ckptthread(void);
 
 void
 initlog(int dev, struct superblock *sb)
@@ -61,65 +153,167 @@ initlog(int dev, struct superblock *sb)
   log.start = sb->logstart;
   log.size = sb->nlog;
   log.dev = dev;
+  if (log.size < 2*(TXNSIZE+1) + 1)
+    panic("initlog: log too small");
   recover_from_log();
+  kthread("log", logthread);
+  kthread("checkpoint", ckptthread);
 }
 
-// Copy committed blocks from log to their home location
-static void
-install_trans(int recovering)
+// CRC-32 of the n bytes at p, continuing from crc.
+static uint
+crc32(uint crc, void *p, int n)
 {
-  int tail;
+  uchar *s = p;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
+  crc = ~crc;
+  while (n-- > 0) {
+    crc ^= *s++;
+    for (int k = 0; k < 8; k++)
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
   }
+  return ~crc;
 }
 
-// Read the log header from disk into the in-memory log header
+// Write the log super block: the log now starts at offset
+// tail, with transaction seq.
 static void
-read_head(void)
+write_super(int tail, uint seq)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *lh = (struct logheader *) (buf->data);
-  int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
-  }
+  struct buf *buf = bgetblk(log.dev, log.start);
+  struct logsuper *ls = (struct logsuper *) (buf->data);
+  memset(buf->data, 0, BSIZE);
+  ls->magic = LOGMAGIC;
+  ls->tail = tail;
+  ls->seq = seq;
+  ls->checksum = crc32(0, ls, 3 * sizeof(uint));
+  bwrite(buf);
   brelse(buf);
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
-static void
-write_head(void)
+// Read the header of the transaction at log offset pos into
+// *lh, if it is transaction seq and made it to disk whole.
+static int
+read_head(int pos, uint seq, struct logheader *lh)
 {
-  struct buf *buf = bread(log.dev, log.start);
+  struct buf *buf = bread(log.dev, log.start+pos);
   struct logheader *hb = (struct logheader *) (buf->data);
+  uint sum;
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+  if (hb->seq != seq || hb->n <= 0 || hb->n > TXNSIZE ||
+      pos + hb->n + 1 > log.size) {
+    brelse(buf);
+    return 0;
   }
-  bwrite(buf);
+  sum = crc32(0, hb, (hb->n + 2) * sizeof(int));
+  for (i = 0; i < hb->n; i++) {
+    struct buf *lbuf = bread(log.dev, log.start+pos+i+1);
+    sum = crc32(sum, lbuf->data, BSIZE);
+    brelse(lbuf);
+  }
+  if (sum != hb->checksum) {
+    brelse(buf);
+    return 0;
+  }
+  *lh = *hb;
   brelse(buf);
+  return 1;
 }
 
+// Install every complete transaction from the tail on, in
+// order, and empty the log.
 static void
 recover_from_log(void)
 {
-  read_head();
-  install_trans(1); // if committed, copy from log to disk
-  log.lh.n = 0;
-  write_head(); // clear the log
+  struct buf *buf = bread(log.dev, log.start);
+  struct logsuper ls = *(struct logsuper *) (buf->data);
+  struct logheader lh;
+  int pos;
+  uint seq;
+  brelse(buf);
+
+  if (ls.magic != LOGMAGIC || ls.checksum != crc32(0, &ls, 3 * sizeof(uint)) ||
+      ls.tail < 1 || ls.tail >= log.size) {
+    // a fresh file system.
+    ls.tail = 1;
+    ls.seq = 1;
+  }
+
+  pos = ls.tail;
+  seq = ls.seq;
+  for (;;) {
+    if (!read_head(pos, seq, &lh)) {
+      // perhaps it didn't fit, and wrapped round.
+      if (pos == 1 || !read_head(1, seq, &lh))
+        break;
+      pos = 1;
+    }
+    for (int i = 0; i < lh.n; i++) {
+      struct buf *lbuf = bread(log.dev, log.start+pos+i+1); // read log block
+      struct buf *dbuf = bread(log.dev, lh.block[i]); // read dst
+      memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
+      bwrite(dbuf);  // write dst to disk
+      brelse(lbuf);
+      brelse(dbuf);
+    }
+    pos += lh.n + 1;
+    if (pos >= log.size)
+      pos = 1;
+    seq++;
+  }
+
+  write_super(pos, seq); // clear the log
+  log.tail = log.head = pos;
+  log.seq = seq;
+  log.done = seq - 1;
+}
+
+// Where can a transaction of n blocks go in the log?
+// Returns -1 if there is no room until after a checkpoint.
+// Caller holds log.lock.
+static int
+logroom(int n)
+{
+  if (log.ntxn == NTXN)
+    return -1;
+  if (log.ntxn > 0 && log.head <= log.tail)
+    return log.head + n + 1 <= log.tail ? log.head : -1;
+  if (log.head + n + 1 <= log.size)
+    return log.head;
+  if (log.ntxn == 0 || 1 + n + 1 <= log.tail)
+    return 1;
+  return -1;
+}
+
+// How much of the log is in use? Caller holds log.lock.
+static int
+logused(void)
+{
+  if (log.ntxn == 0)
+    return 0;
+  if (log.head > log.tail)
+    return log.head - log.tail;
+  return log.size - log.tail + log.head - 1;
+}
+
+// ask the log thread to commit the running transaction now.
+// caller holds log.lock.
+static void
+kick(void)
+{
+  log.urgent = 1;
+  wakeup(&log.outstanding);
+  wakeup(&log.delaying);
+}
+
+// called by the clock interrupt, every tick.
+void
+log_tick(void)
+{
+  // a racy peek, but the log thread sets delaying before
+  // it sleeps, so at worst it waits another tick.
+  if(log.delaying)
+    wakeup(&log.delaying);
 }
 
 // called at the start of each FS system call.
@@ -128,13 +322,16 @@ begin_op(void)
 {
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.closing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
-      // this op might exhaust log space; wait for commit.
+    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > TXNSIZE){
+      // this op might exhaust the transaction; wait for the log
+      // thread to take it.
+      kick();
       sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
+      myproc()->opblocks = 0;
       release(&log.lock);
       break;
     }
@@ -142,69 +339,292 @@ begin_op(void)
 }
 
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// waits until the transaction has committed, if it
+// has anything to commit, and the process isn't relaxed.
 void
 end_op(void)
 {
-  int do_commit = 0;
+  uint seq;
 
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
+  // the log thread may be waiting to close the transaction,
+  // and begin_op() may be waiting for log space,
+  // and decrementing log.outstanding has decreased
+  // the amount of reserved space.
+  wakeup(&log.outstanding);
+  wakeup(&log);
+  // this op holds the transaction open until here, so seq is
+  // still the one it wrote to, if it wrote anything.
+  if(log.lh.n > 0 && !myproc()->relaxed){
+    seq = log.seq;
+    kick();
+    while(log.done < seq)
+      sleep(&log.done, &log.lock);
+  }
+  release(&log.lock);
+}
+
+// wait until every FS sys call that has finished is committed.
+void
+log_sync(void)
+{
+  uint seq;
+
+  acquire(&log.lock);
+  if(log.lh.n > 0){
+    seq = log.seq;
+    kick();
   } else {
-    // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
-    wakeup(&log);
+    seq = log.seq - 1;  // perhaps still being written
   }
+  while(log.done < seq)
+    sleep(&log.done, &log.lock);
   release(&log.lock);
+}
+
+// Write the header and the modified blocks, from their copies,
+// to the log at offset pos as one disk request. This is the
+// true point at which the current transaction commits.
+static void
+write_log(int pos, uint seq)
+{
+  struct buf *bufs[TXNSIZE+1];
+  struct logheader *hb;
+  uint sum;
+  int tail;
+
+  // every log block is overwritten whole: don't read them.
+  bufs[0] = bgetblk(log.dev, log.start+pos); // header
+  hb = (struct logheader *) (bufs[0]->data);
+  memset(hb, 0, BSIZE);
+  hb->n = log.clh.n;
+  hb->seq = seq;
+  for (tail = 0; tail < log.clh.n; tail++) {
+    hb->block[tail] = log.clh.block[tail];
+  }
+  sum = crc32(0, hb, (hb->n + 2) * sizeof(int));
+  for (tail = 0; tail < log.clh.n; tail++) {
+    struct buf *to = bgetblk(log.dev, log.start+pos+tail+1); // log block
+    memmove(to->data, log.copy[tail], BSIZE);
+    sum = crc32(sum, to->data, BSIZE);
+    bufs[tail+1] = to;
+  }
+  hb->checksum = sum;
+  bwritev(bufs, log.clh.n + 1);  // write the log
+  for (tail = 0; tail <= log.clh.n; tail++) {
+    brelse(bufs[tail]);
+  }
+}
+
+// Append the closed transaction to the log, once there is room.
+static void
+commit(uint seq)
+{
+  struct txn *t;
+  int pos;
+
+  acquire(&log.lock);
+  while ((pos = logroom(log.clh.n)) < 0) {
+    log.needroom = 1;
+    wakeup(&log.ntxn);
+    sleep(&log.tail, &log.lock);
+  }
+  release(&log.lock);
+
+  write_log(pos, seq);  // Write header and blocks -- the real commit
+
+  acquire(&log.lock);
+  t = &log.txns[(log.txtail + log.ntxn) % NTXN];
+  t->seq = seq;
+  t->pos = pos;
+  t->n = log.clh.n;
+  memmove(t->block, log.clh.block, log.clh.n * sizeof(int));
+  // if the log was empty, the super block has the old head,
+  // with seq; recovery looks just after the super block too.
+  if (log.ntxn++ == 0)
+    log.tail = pos;
+  log.head = pos + log.clh.n + 1;
+  log.writing = 0;
+  log.done = seq;
+  wakeup(&log.done);
+  if (logused() > log.size / 2)
+    wakeup(&log.ntxn);
+  release(&log.lock);
+
+  // the frees are committed. no one looks at this bitmap again
+  // until the transaction after next, which this thread starts.
+  if (log.nfreed[seq % 2] > 0) {
+    memset(log.freed[seq % 2], 0, sizeof(log.freed[0]));
+    log.nfreed[seq % 2] = 0;
+  }
+}
+
+// The log thread: take the running transaction once it has
+// updates, wait for the FS sys calls in it to finish, copy its
+// blocks, and commit it while the next one runs.
+static void
+logthread(void)
+{
+  uint seq;
+
+  acquire(&log.lock);
+  for(;;){
+    while(log.lh.n == 0)
+      sleep(&log.outstanding, &log.lock);
+    if(!log.urgent){
+      // only relaxed updates: let more join, for a while.
+      acquire(&tickslock);
+      uint age = ticks - log.dirtied;
+      release(&tickslock);
+      if(age < COMMITDELAY){
+        log.delaying = 1;
+        sleep(&log.delaying, &log.lock);
+        log.delaying = 0;
+        continue;
+      }
+    }
+
+    log.urgent = 0;
+    log.closing = 1;
+    while(log.outstanding > 0)
+      sleep(&log.outstanding, &log.lock);
+    log.clh = log.lh;
+    log.lh.n = 0;
+    log.writing = 1;
+    seq = log.seq++;
+    release(&log.lock);
+
+    // no FS sys call can run while we copy; the blocks are
+    // pinned in the cache, so this doesn't touch the disk.
+    for (int i = 0; i < log.clh.n; i++) {
+      struct buf *b = bread(log.dev, log.clh.block[i]);
+      memmove(log.copy[i], b->data, BSIZE);
+      brelse(b);
+    }
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
     acquire(&log.lock);
-    log.committing = 0;
+    log.closing = 0;
     wakeup(&log);
     release(&log.lock);
+
+    commit(seq);
+
+    acquire(&log.lock);
+  }
+}
+
+// Is block in a transaction that hasn't committed yet?
+// Caller holds log.lock.
+static int
+uncommitted(int blockno)
+{
+  for (int i = 0; i < log.lh.n; i++)
+    if (log.lh.block[i] == blockno)
+      return 1;
+  if (log.writing)
+    for (int i = 0; i < log.clh.n; i++)
+      if (log.clh.block[i] == blockno)
+        return 1;
+  return 0;
+}
+
+// Is block in a committed transaction newer than the k'th
+// oldest? Caller holds log.lock.
+static int
+relogged(int k, int blockno)
+{
+  for (k++; k < log.ntxn; k++) {
+    struct txn *t = &log.txns[(log.txtail + k) % NTXN];
+    for (int i = 0; i < t->n; i++)
+      if (t->block[i] == blockno)
+        return 1;
   }
+  return 0;
 }
 
-// Copy modified blocks from cache to log.
+// Copy the blocks of the k'th oldest committed transaction to
+// their home locations. The cache holds the committed contents
+// of a block, unless a transaction that has yet to commit has
+// modified it since: then write the copy in the log, and put the
+// newer contents back, all without letting go of the buffer. A
+// block that a newer committed transaction logged again is left
+// for that one to install.
 static void
-write_log(void)
+install_trans(int k)
 {
-  int tail;
+  static uchar newer[BSIZE];
+  struct txn *t = &log.txns[(log.txtail + k) % NTXN];
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+  for (int i = 0; i < t->n; i++) {
+    struct buf *dbuf = bread(log.dev, t->block[i]); // read dst
+    acquire(&log.lock);
+    int later = relogged(k, t->block[i]);
+    int stale = uncommitted(t->block[i]);
+    release(&log.lock);
+    if (later) {
+      // nothing to do.
+    } else if (stale) {
+      struct buf *lbuf = bread(log.dev, log.start+t->pos+i+1); // read log block
+      memmove(newer, dbuf->data, BSIZE);
+      memmove(dbuf->data, lbuf->data, BSIZE);
+      bwrite(dbuf);
+      memmove(dbuf->data, newer, BSIZE);
+      brelse(lbuf);
+    } else {
+      bwrite(dbuf);  // write dst to disk
+    }
+    bunpin(dbuf);
+    brelse(dbuf);
   }
 }
 
+// The checkpoint thread: once the log is half full, or the log
+// thread needs room, install the committed transactions and
+// move the log's tail past them.
 static void
-commit()
+ckptthread(void)
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(0); // Now install writes to home locations
-    log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+  int n, tail;
+  uint seq;
+
+  acquire(&log.lock);
+  for(;;){
+    while(log.ntxn == 0 || (!log.needroom && logused() <= log.size / 2))
+      sleep(&log.ntxn, &log.lock);
+    n = log.ntxn;
+    release(&log.lock);
+
+    // the log thread only adds transactions after these.
+    for (int k = 0; k < n; k++)
+      install_trans(k);
+
+    acquire(&log.lock);
+    if (log.ntxn > n) {
+      tail = log.txns[(log.txtail + n) % NTXN].pos;
+      seq = log.txns[(log.txtail + n) % NTXN].seq;
+    } else {
+      tail = log.head;
+      seq = log.done + 1;
+    }
+    release(&log.lock);
+
+    // the blocks are home, but their space in the log is
+    // not free until the super block says so.
+    write_super(tail, seq);
+
+    acquire(&log.lock);
+    log.txtail = (log.txtail + n) % NTXN;
+    log.ntxn -= n;
+    log.tail = log.ntxn > 0 ? log.txns[log.txtail].pos : log.head;
+    log.needroom = 0;
+    wakeup(&log.tail);
   }
 }
 
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache by increasing refcnt.
-// commit()/write_log() will do the disk write.
+// The log thread will do the disk write.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -217,7 +637,7 @@ log_write(struct buf *b)
   int i;
 
   acquire(&log.lock);
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  if (log.lh.n >= TXNSIZE)
     panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
@@ -229,8 +649,51 @@ log_write(struct buf *b)
   log.lh.block[i] = b->blockno;
   if (i == log.lh.n) {  // Add new block to log?
     bpin(b);
-    log.lh.n++;
+    myproc()->opblocks++;
+    if (log.lh.n++ == 0) {
+      acquire(&tickslock);
+      log.dirtied = ticks;
+      release(&tickslock);
+    }
   }
   release(&log.lock);
 }
 
+// Has a transaction not yet committed freed block?
+// Caller holds log.lock.
+static int
+freeing(int blockno)
+{
+  int m = 1 << (blockno % 8);
+
+  if (log.freed[log.seq % 2][blockno / 8] & m)
+    return 1;
+  return log.writing && (log.freed[(log.seq - 1) % 2][blockno / 8] & m);
+}
+
+// Can't block be used for ordered data yet? Not if the log might
+// still write it to its home location: it is in a transaction
+// not yet installed. Nor if a transaction not yet committed
+// frees it.
+int
+log_holds(int blockno)
+{
+  int r;
+
+  acquire(&log.lock);
+  r = uncommitted(blockno) || relogged(-1, blockno) || freeing(blockno);
+  release(&log.lock);
+  return r;
+}
+
+// The running transaction frees block.
+void
+log_free(int blockno)
+{
+  if (blockno / 8 >= sizeof(log.freed[0]))
+    panic("log_free");
+  acquire(&log.lock);
+  log.freed[log.seq % 2][blockno / 8] |= 1 << (blockno % 8);
+  log.nfreed[log.seq % 2]++;
+  release(&log.lock);
+}
@@ -3,7 +3,7 @@
 #define PARAM_H
 
 #ifdef LAB_FS
-#define NPROC        10  // maximum number of processes
+#define NPROC        12  // maximum number of processes, and the log threads
 #else
 #define NPROC        64  // maximum number of processes (speedsup bigfile)
 #endif
@@ -15,8 +15,15 @@
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
+#define TXNSIZE      (MAXOPBLOCKS*3)  // max data blocks in a log transaction
+#define LOGSIZE      ((TXNSIZE+1)*3)  // blocks in on-disk log, with its super block
+#define NRUN         16  // most ordered data blocks writei() holds at once
+// size of disk block cache: blocks pinned by the log, plus what
+// every process may hold at once.
+#define NBUF         (LOGSIZE + TXNSIZE + NPROC*(NRUN + MAXOPBLOCKS))
+#define NDCACHE     128  // size of directory entry cache
+#define COMMITDELAY  10  // max ticks relaxed FS sys calls wait for commit
+#define ORDERED       1  // file data bypasses the log, written home before commit
 #ifdef LAB_FS
 #define FSSIZE       200000  // size of file system in blocks
 #else
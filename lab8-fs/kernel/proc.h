@@ -109,6 +109,9 @@ struct proc {
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
+  void (*kfn)(void);           // Body of a kernel thread, see kthread()
+  int relaxed;                 // FS sys calls don't wait for commit, see log.c
+  int opblocks;                // blocks the current FS op added to the log
 };
 
 #endif // PROC_H
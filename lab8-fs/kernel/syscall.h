@@ -25,5 +25,8 @@
 #define SYS_mkdir  20
 #define SYS_close  21
 #define SYS_symlink 22
+#define SYS_fsync  23
+#define SYS_sync   24
+#define SYS_relaxed 25
 
 #endif // SYSCALL_H
@@ -95,3 +95,18 @@ sys_uptime(void)
   release(&tickslock);
   return xticks;
 }
+
+// relaxed(1): from now on, this process's FS system calls, and
+// its children's, return before their updates are on disk; the
+// log commits them within COMMITDELAY ticks, or at fsync()/sync().
+// relaxed(0) goes back to waiting for each commit.
+uint64
+sys_relaxed(void)
+{
+  int on;
+
+  if(argint(0, &on) < 0)
+    return -1;
+  myproc()->relaxed = (on != 0);
+  return 0;
+}
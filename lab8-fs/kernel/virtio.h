@@ -48,8 +48,9 @@
 #define VIRTIO_RING_F_EVENT_IDX     29
 
 // this many virtio descriptors.
-// must be a power of two.
-#define NUM 8
+// must be a power of two, and leave room for a request for
+// a whole log transaction (see virtio_disk_rwv()).
+#define NUM 64
 
 // a single descriptor, from the spec.
 struct virtq_desc {
@@ -30,6 +30,9 @@ char* sbrk(int);
 int sleep(int);
 int uptime(void);
 int symlink(char *target, char *path);
+int fsync(int);
+int sync(void);
+int relaxed(int);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -574,6 +574,95 @@ writetest(char *s)
   }
 }
 
+// writes from a relaxed process, which don't wait for their
+// commit, must still read back, and fsync()/sync() must work.
+void
+relaxedtest(char *s)
+{
+  int fd, i, pid, xstatus;
+  int fds[2];
+  enum { N=50, SZ=10 };
+
+  if(relaxed(1) != 0){
+    printf("%s: relaxed failed\n", s);
+    exit(1);
+  }
+  fd = open("relaxed", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create relaxed failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    if(write(fd, "aaaaaaaaaa", SZ) != SZ){
+      printf("%s: write %d failed\n", s, i);
+      exit(1);
+    }
+  }
+  if(fsync(fd) != 0){
+    printf("%s: fsync failed\n", s);
+    exit(1);
+  }
+
+  // a child inherits the mode.
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(i = 0; i < N; i++){
+      if(write(fd, "bbbbbbbbbb", SZ) != SZ){
+        printf("%s: child write %d failed\n", s, i);
+        exit(1);
+      }
+    }
+    if(sync() != 0){
+      printf("%s: sync failed\n", s);
+      exit(1);
+    }
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+  close(fd);
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if(fsync(fds[0]) != -1){
+    printf("%s: fsync of a pipe succeeded\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+  if(fsync(fds[0]) != -1){
+    printf("%s: fsync of a closed fd succeeded\n", s);
+    exit(1);
+  }
+
+  if(relaxed(0) != 0){
+    printf("%s: relaxed(0) failed\n", s);
+    exit(1);
+  }
+  fd = open("relaxed", O_RDONLY);
+  if(fd < 0){
+    printf("%s: open relaxed failed\n", s);
+    exit(1);
+  }
+  i = read(fd, buf, N*SZ*2);
+  if(i != N*SZ*2 || buf[0] != 'a' || buf[N*SZ] != 'b'){
+    printf("%s: read back failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(unlink("relaxed") < 0){
+    printf("%s: unlink relaxed failed\n", s);
+    exit(1);
+  }
+}
+
 void
 writebig(char *s)
 {
@@ -2869,6 +2958,7 @@ main(int argc, char *argv[])
     {stacktest, "stacktest"},
     {opentest, "opentest"},
     {writetest, "writetest"},
+    {relaxedtest, "relaxed"},
     {writebig, "writebig"},
     {createtest, "createtest"},
     {openiputtest, "openiput"},
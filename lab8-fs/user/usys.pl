@@ -37,3 +37,6 @@ entry("sbrk");
 entry("sleep");
 entry("uptime");
 entry("symlink");
+entry("fsync");
+entry("sync");
+entry("relaxed");
@@ -12,6 +12,7 @@ struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct vma;
 
 // bio.c
 void            binit(void);
@@ -44,6 +45,7 @@ int             dirlink(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
 struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
+struct inode*   iget(uint, uint);
 void            iinit();
 void            ilock(struct inode*);
 void            iput(struct inode*);
@@ -67,6 +69,8 @@ void            ramdiskrw(struct buf*);
 void*           kalloc(void);
 void            kfree(void *);
 void            kinit(void);
+void*           krealloc(void *);
+void*           kmake_unique(void *);
 
 // log.c
 void            initlog(int, struct superblock*);
@@ -74,6 +78,24 @@ void            log_write(struct buf*);
 void            begin_op(void);
 void            end_op(void);
 
+// pagecache.c
+void            pcacheinit(void);
+uint64          pcache_get(struct inode*, uint);
+void            pcache_dup(uint64);
+void            pcache_put(uint64);
+int             pcache_read(struct inode*, int, uint64, uint, uint);
+void            pcache_write(struct inode*, uint, char*, uint);
+void            pcache_inval(struct inode*);
+int             pcache_drop(struct inode*, uint, uint);
+void            pcache_shrink(void);
+void            pcache_setdirty(uint64, struct inode*);
+void            pcache_sync(struct inode*, uint, uint);
+void            pcache_kick(void);
+void            pcache_flusher(void);
+uint64          pcache_peek(struct inode*, uint);
+void            pcache_prefetch(struct inode*, uint, uint);
+void            pcache_prefetcher(void);
+
 // pipe.c
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
@@ -108,6 +130,7 @@ void            yield(void);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
+void            kthread_create(void (*)(void), char*);
 
 // swtch.S
 void            swtch(struct context*, struct context*);
@@ -149,6 +172,13 @@ void            trapinit(void);
 void            trapinithart(void);
 extern struct spinlock tickslock;
 void            usertrapret(void);
+int             pagefault(uint64, int);
+
+// sysfile.c
+void            mmapharvest(struct proc*);
+void            mmapwriteback(struct inode*, uint, uint64);
+void            munmapall(struct proc*, pagetable_t);
+int             vmacopy(struct vma*, pagetable_t, pagetable_t);
 
 // uart.c
 void            uartinit(void);
@@ -165,6 +195,8 @@ int             mappages(pagetable_t, uint64, uint64, uint64, int);
 pagetable_t     uvmcreate(void);
 void            uvminit(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64);
+uint64          uvmlazy(pagetable_t, uint64, uint64);
+void            uvmprefault(uint64, uint64, int);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
 void            uvmfree(pagetable_t, uint64);
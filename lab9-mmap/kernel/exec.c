@@ -3,21 +3,36 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "defs.h"
+#include "fs.h"
+#include "file.h"
 #include "elf.h"
 
 static int loadseg(pde_t *pgdir, uint64 addr, struct inode *ip, uint offset, uint sz);
 
+static int
+flags2perm(int flags)
+{
+  int perm = PTE_R | PTE_U;
+  if(flags & ELF_PROG_FLAG_EXEC)
+    perm |= PTE_X;
+  if(flags & ELF_PROG_FLAG_WRITE)
+    perm |= PTE_W;
+  return perm;
+}
+
 int
 exec(char *path, char **argv)
 {
   char *s, *last;
-  int i, off;
+  int i, off, nseg = 0;
   uint64 argc, sz = 0, sp, ustack[MAXARG], stackbase;
   struct elfhdr elf;
-  struct inode *ip;
+  struct inode *ip, *exe = 0, *oldexe;
   struct proghdr ph;
+  struct seg segs[NSEG];
   pagetable_t pagetable = 0, oldpagetable;
   struct proc *p = myproc();
 
@@ -38,7 +53,10 @@ exec(char *path, char **argv)
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Load program into memory: only reserve the pages of the
+  // first NSEG segments, pagefault() reads them in on first
+  // touch; load any further ones right away.
+  memset(segs, 0, sizeof(segs));
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
@@ -48,15 +66,31 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr + ph.memsz < ph.vaddr)
       goto bad;
+    if((ph.vaddr % PGSIZE) != 0)
+      goto bad;
+    if(ph.off + ph.filesz < ph.off || ph.off + ph.filesz > ip->size)
+      goto bad;
     uint64 sz1;
+    if(nseg < NSEG){
+      if((sz1 = uvmlazy(pagetable, sz, ph.vaddr + ph.memsz)) == 0)
+        goto bad;
+      segs[nseg].va_ = ph.vaddr;
+      segs[nseg].filesz_ = ph.filesz;
+      segs[nseg].offset_ = ph.off;
+      segs[nseg].memsz_ = ph.memsz;
+      segs[nseg].perm_ = flags2perm(ph.flags);
+      nseg++;
+      sz = sz1;
+      continue;
+    }
     if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz)) == 0)
       goto bad;
     sz = sz1;
-    if((ph.vaddr % PGSIZE) != 0)
-      goto bad;
     if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
       goto bad;
   }
+  if(nseg > 0)
+    exe = idup(ip);
   iunlockput(ip);
   end_op();
   ip = 0;
@@ -110,11 +144,20 @@ exec(char *path, char **argv)
     
   // Commit to the user image.
   oldpagetable = p->pagetable;
+  munmapall(p, oldpagetable);
+  oldexe = p->exe_;
+  p->exe_ = exe;
+  memmove(p->segs_, segs, sizeof(segs));
   p->pagetable = pagetable;
   p->sz = sz;
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
   proc_freepagetable(oldpagetable, oldsz);
+  if(oldexe){
+    begin_op();
+    iput(oldexe);
+    end_op();
+  }
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
@@ -125,6 +168,11 @@ exec(char *path, char **argv)
     iunlockput(ip);
     end_op();
   }
+  if(exe){
+    begin_op();
+    iput(exe);
+    end_op();
+  }
   return -1;
 }
 
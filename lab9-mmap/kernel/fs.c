@@ -187,7 +187,6 @@ iinit()
   }
 }
 
-static struct inode* iget(uint dev, uint inum);
 
 // Allocate an inode on device dev.
 // Mark it as allocated by  giving it type type.
@@ -239,7 +238,7 @@ iupdate(struct inode *ip)
 // Find the inode with number inum on device dev
 // and return the in-memory copy. Does not lock
 // the inode and does not read it from disk.
-static struct inode*
+struct inode*
 iget(uint dev, uint inum)
 {
   struct inode *ip, *empty;
@@ -413,6 +412,8 @@ itrunc(struct inode *ip)
   struct buf *bp;
   uint *a;
 
+  pcache_inval(ip);
+
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
       bfree(ip->dev, ip->addrs[i]);
@@ -456,6 +457,7 @@ int
 readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 {
   uint tot, m;
+  int r;
   struct buf *bp;
 
   if(off > ip->size || off + n < off)
@@ -464,8 +466,16 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
     n = ip->size - off;
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
     m = min(n - tot, BSIZE - off%BSIZE);
+    // a cached page may hold stores made through a mapping.
+    if((r = pcache_read(ip, user_dst, dst, off, m)) != 0){
+      if(r < 0){
+        tot = -1;
+        break;
+      }
+      continue;
+    }
+    bp = bread(ip->dev, bmap(ip, off/BSIZE));
     if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
       brelse(bp);
       tot = -1;
@@ -501,6 +511,7 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
       brelse(bp);
       break;
     }
+    pcache_write(ip, off, (char*)bp->data + (off % BSIZE), m);
     log_write(bp);
     brelse(bp);
   }
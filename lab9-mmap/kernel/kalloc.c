@@ -14,6 +14,10 @@ void freerange(void *pa_start, void *pa_end);
 extern char end[]; // first address after kernel.
                    // defined by kernel.ld.
 
+// reference counts of the physical pages, so that
+// copy-on-write and shared mappings can share frames.
+static ushort ref_counts[NPHYSPAGE];
+
 struct run {
   struct run *next;
 };
@@ -23,10 +27,23 @@ struct {
   struct run *freelist;
 } kmem;
 
+// index of physical page pa in ref_counts[]
+static int
+pa2ref_idx(uint64 pa) {
+  if (pa < KERNBASE || pa >= PHYSTOP)
+    panic("pa2ref_idx");
+  return (pa - KERNBASE) / PGSIZE;
+}
+
 void
 kinit()
 {
   initlock(&kmem.lock, "kmem");
+
+  // freerange() kfree()s every page, which drops its count to 0.
+  for (int i = 0; i < NPHYSPAGE; ++i) {
+    ref_counts[i] = 1U;
+  }
   freerange(end, (void*)PHYSTOP);
 }
 
@@ -51,6 +68,20 @@ kfree(void *pa)
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  // decrement ref count
+  acquire(&kmem.lock);
+  int idx = pa2ref_idx((uint64) pa);
+  if (ref_counts[idx] == 0U) {
+    release(&kmem.lock);
+    panic("kfree: ref count is 0\n");
+  }
+  if (--ref_counts[idx] > 0U) {
+    // still have refs to it!
+    release(&kmem.lock);
+    return;
+  }
+  release(&kmem.lock);
+
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
 
@@ -72,11 +103,69 @@ kalloc(void)
 
   acquire(&kmem.lock);
   r = kmem.freelist;
-  if(r)
+  if(r) {
     kmem.freelist = r->next;
+    ref_counts[pa2ref_idx((uint64)r)] = 1;
+  }
   release(&kmem.lock);
 
   if(r)
     memset((char*)r, 5, PGSIZE); // fill with junk
   return (void*)r;
 }
+
+// realloc page: simply increment ref count!
+// panic if the page is not allocated by kalloc before.
+void *
+krealloc(void *pa) {
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("krealloc");
+
+  acquire(&kmem.lock); 
+  const int idx = pa2ref_idx((uint64) pa);
+  if (ref_counts[idx] == 0 || ref_counts[idx] == (ushort)-1) {
+    release(&kmem.lock); 
+    panic("krealloc");
+  } 
+  ++ref_counts[idx];
+  release(&kmem.lock); 
+
+  return pa;
+}
+
+// make a unique copy from a page, return 0 if cannot fetch new pages.
+// if pa is not shared, it is returned as is.
+void *
+kmake_unique(void *pa) {
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kmake_unique");
+
+  acquire(&kmem.lock); 
+  const int idx = pa2ref_idx((uint64)pa);  // index into the ref counts
+  if (ref_counts[idx] == 0) {
+    // not allocated, abort.
+    release(&kmem.lock);
+    return 0;
+  }
+
+  if (ref_counts[idx] == 1) {
+    // this is not a shared page, just return pa.
+    release(&kmem.lock);
+    return pa;
+  }
+
+  // look for a new page.
+  struct run *r;
+  r = kmem.freelist;
+  if(r) {
+    kmem.freelist = r->next;
+    --ref_counts[idx];
+    // set ref count of this unique page
+    ref_counts[pa2ref_idx((uint64)r)] = 1;
+    // copy the data of the page
+    memmove(r, pa, PGSIZE);
+  } 
+  release(&kmem.lock);
+
+  return (void *)r;
+}
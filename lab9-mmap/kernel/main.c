@@ -25,10 +25,13 @@ main()
     plicinit();      // set up interrupt controller
     plicinithart();  // ask PLIC for device interrupts
     binit();         // buffer cache
+    pcacheinit();    // file page cache
     iinit();         // inode table
     fileinit();      // file table
     virtio_disk_init(); // emulated hard disk
     userinit();      // first user process
+    kthread_create(pcache_flusher, "pcflush"); // mmap write-back
+    kthread_create(pcache_prefetcher, "pcfetch"); // mmap read-ahead
     __sync_synchronize();
     started = 1;
   } else {
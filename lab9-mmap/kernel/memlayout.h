@@ -50,6 +50,7 @@
 // from physical address 0x80000000 to PHYSTOP.
 #define KERNBASE 0x80000000L
 #define PHYSTOP (KERNBASE + 128*1024*1024)
+#define NPHYSPAGE ((PHYSTOP - KERNBASE) / PGSIZE)  // pages of RAM
 
 // map the trampoline page to the highest address,
 // in both user and kernel space.
@@ -66,8 +67,11 @@
 //   fixed-size stack
 //   expandable heap
 //   ...
+//   mmap() regions, growing down from MMAPTOP
+//   unmapped guard page
 //   TRAPFRAME (p->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
+#define MMAPTOP (TRAPFRAME - PGSIZE)
 
 #endif // MEMLAYOUT_H
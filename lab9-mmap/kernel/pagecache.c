@@ -0,0 +1,702 @@
+// Page cache.
+//
+// The page cache holds whole pages of file data, keyed by
+// (dev, inum, page-aligned file offset), so that every process
+// mapping the same file with mmap() shares one physical frame per
+// page.  readi() and writei() consult it as well, so that file reads
+// see stores made through shared mappings and file writes show up
+// in them.
+//
+// Interface:
+// * pcache_get() returns the frame caching a page of a locked
+//   inode, reading it from disk on a miss, with one more reference.
+// * pcache_dup() adds a reference to a cached frame (fork).
+// * pcache_put() drops a reference.  Unreferenced pages stay
+//   cached until their slot is recycled.
+// * pcache_inval() detaches every page of an inode, e.g. when
+//   it is truncated or freed.
+// * pcache_setdirty() records that a page was stored to through
+//   a shared mapping.  The pcflush kernel thread writes dirty
+//   pages back in small batches; pcache_sync() does it at once
+//   for a range of a file (msync).
+// * pcache_peek() returns a page only if it is already cached.
+// * pcache_prefetch() queues pages for the pcfetch kernel
+//   thread to read in (read-ahead, MADV_WILLNEED).
+//
+// The page contents are protected by the inode's sleep-lock;
+// pcache.lock only protects the table itself.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "riscv.h"
+#include "memlayout.h"
+#include "proc.h"
+#include "defs.h"
+#include "fs.h"
+#include "file.h"
+
+struct pcpage {
+  uint dev;
+  uint inum;
+  uint off;             // page-aligned file offset
+  int ref;              // mappings plus transient holders
+  int valid;            // holds file data and is on a hash chain
+  int dirty;            // stored to through a mapping since written back
+  struct inode *ip;     // referenced while dirty, for write-back
+  uint64 pa;            // cached frame, 0 if none yet
+  struct pcpage *hnext; // hash chain
+  struct pcpage *prev;  // LRU list
+  struct pcpage *next;
+};
+
+// A queued prefetch request, holding a reference to ip.
+struct pcfetch {
+  struct inode *ip;
+  uint off;
+  uint npages;
+};
+
+struct {
+  struct spinlock lock;
+  struct pcpage page[NPCACHE];
+  struct pcpage *hash[NPCHASH];
+  int kick;             // wake the flusher before its next tick
+
+  // ring of prefetch requests, fetchr <= fetchw
+  struct pcfetch fetch[NPREFETCH];
+  uint fetchr;
+  uint fetchw;
+
+  // Linked list of all pages, through prev/next.
+  // head.next is most recently used, head.prev is least.
+  struct pcpage head;
+
+  // for each frame of RAM, 1 + the index in page[] of the page
+  // it caches, or 0.
+  ushort slot[NPHYSPAGE];
+} pcache;
+
+static inline uint
+pcache_hash(uint dev, uint inum, uint off)
+{
+  return (dev * 31 + inum * 17 + (off >> PGSHIFT)) % NPCHASH;
+}
+
+void
+pcacheinit(void)
+{
+  struct pcpage *pg;
+
+  initlock(&pcache.lock, "pcache");
+  pcache.head.prev = &pcache.head;
+  pcache.head.next = &pcache.head;
+  for(pg = pcache.page; pg < pcache.page+NPCACHE; pg++){
+    pg->next = pcache.head.next;
+    pg->prev = &pcache.head;
+    pcache.head.next->prev = pg;
+    pcache.head.next = pg;
+  }
+}
+
+// Find a valid page. Caller must hold pcache.lock.
+static struct pcpage*
+pcache_lookup(uint dev, uint inum, uint off)
+{
+  struct pcpage *pg;
+
+  for(pg = pcache.hash[pcache_hash(dev, inum, off)]; pg; pg = pg->hnext)
+    if(pg->dev == dev && pg->inum == inum && pg->off == off)
+      return pg;
+  return 0;
+}
+
+// Find the page caching frame pa. Caller must hold pcache.lock.
+static struct pcpage*
+pcache_findpa(uint64 pa)
+{
+  struct pcpage *pg;
+  int i;
+
+  if(pa < KERNBASE || pa >= PHYSTOP)
+    return 0;
+  if((i = pcache.slot[(pa - KERNBASE) / PGSIZE]) == 0)
+    return 0;
+  pg = &pcache.page[i-1];
+  if(pg->pa != pa || pg->ref == 0)
+    return 0;
+  return pg;
+}
+
+// Remove pg from its hash chain. Caller must hold pcache.lock.
+static void
+pcache_unhash(struct pcpage *pg)
+{
+  struct pcpage **pp;
+
+  for(pp = &pcache.hash[pcache_hash(pg->dev, pg->inum, pg->off)]; *pp; pp = &(*pp)->hnext){
+    if(*pp == pg){
+      *pp = pg->hnext;
+      break;
+    }
+  }
+  pg->hnext = 0;
+  pg->valid = 0;
+}
+
+// Move pg to the front of the LRU list. Caller must hold pcache.lock.
+static void
+pcache_touch(struct pcpage *pg)
+{
+  pg->next->prev = pg->prev;
+  pg->prev->next = pg->next;
+  pg->next = pcache.head.next;
+  pg->prev = &pcache.head;
+  pcache.head.next->prev = pg;
+  pcache.head.next = pg;
+}
+
+// Return the frame caching the page of ip at offset off,
+// reading it from disk if it is not cached, with its
+// reference count incremented.  Bytes past the end of
+// the file read as zero.  Returns 0 if the cache is full
+// or out of memory.  Caller must hold ip->lock.
+uint64
+pcache_get(struct inode *ip, uint off)
+{
+  struct pcpage *pg;
+  uint64 pa;
+
+  if(!holdingsleep(&ip->lock))
+    panic("pcache_get");
+  off = PGROUNDDOWN(off);
+
+  acquire(&pcache.lock);
+  if((pg = pcache_lookup(ip->dev, ip->inum, off)) != 0){
+    pg->ref++;
+    pcache_touch(pg);
+    release(&pcache.lock);
+    return pg->pa;
+  }
+
+  // Not cached.
+  // Recycle the least recently used clean unreferenced page.
+  for(pg = pcache.head.prev; pg != &pcache.head; pg = pg->prev)
+    if(pg->ref == 0 && !pg->dirty)
+      break;
+  if(pg == &pcache.head){
+    pcache.kick = 1;
+    release(&pcache.lock);
+    return 0;
+  }
+  if(pg->valid)
+    pcache_unhash(pg);
+  pg->ref = 1;
+  release(&pcache.lock);
+
+  // Nobody else can fill this page while we hold ip->lock,
+  // so read it in before making it visible.
+  if((pa = pg->pa) == 0 && (pa = (uint64)kalloc()) == 0){
+    acquire(&pcache.lock);
+    pg->ref = 0;
+    release(&pcache.lock);
+    return 0;
+  }
+  memset((void*)pa, 0, PGSIZE);
+  readi(ip, 0, pa, off, PGSIZE);
+
+  acquire(&pcache.lock);
+  pg->pa = pa;
+  pcache.slot[(pa - KERNBASE) / PGSIZE] = pg - pcache.page + 1;
+  pg->dev = ip->dev;
+  pg->inum = ip->inum;
+  pg->off = off;
+  pg->valid = 1;
+  pg->hnext = pcache.hash[pcache_hash(pg->dev, pg->inum, off)];
+  pcache.hash[pcache_hash(pg->dev, pg->inum, off)] = pg;
+  pcache_touch(pg);
+  release(&pcache.lock);
+  return pa;
+}
+
+// Like pcache_get(), but never reads from disk: returns 0
+// if the page is not cached. ip need not be locked.
+uint64
+pcache_peek(struct inode *ip, uint off)
+{
+  struct pcpage *pg;
+  uint64 pa = 0;
+
+  acquire(&pcache.lock);
+  if((pg = pcache_lookup(ip->dev, ip->inum, PGROUNDDOWN(off))) != 0){
+    pg->ref++;
+    pa = pg->pa;
+  }
+  release(&pcache.lock);
+  return pa;
+}
+
+// Add a reference to the cached frame pa.
+void
+pcache_dup(uint64 pa)
+{
+  struct pcpage *pg;
+
+  acquire(&pcache.lock);
+  if((pg = pcache_findpa(pa)) == 0)
+    panic("pcache_dup");
+  pg->ref++;
+  release(&pcache.lock);
+}
+
+// Drop a reference to the cached frame pa.
+// The page stays cached for later mappings and reads.
+void
+pcache_put(uint64 pa)
+{
+  struct pcpage *pg;
+
+  acquire(&pcache.lock);
+  if((pg = pcache_findpa(pa)) == 0)
+    panic("pcache_put");
+  pg->ref--;
+  release(&pcache.lock);
+}
+
+// Copy n bytes of ip at offset off to dst, if that page is cached.
+// The range must not cross a page boundary.
+// Returns 1 if the copy was done, 0 if the page is not cached,
+// -1 if the copy failed.  Caller must hold ip->lock.
+int
+pcache_read(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
+{
+  struct pcpage *pg;
+  int r;
+
+  acquire(&pcache.lock);
+  if((pg = pcache_lookup(ip->dev, ip->inum, PGROUNDDOWN(off))) == 0){
+    release(&pcache.lock);
+    return 0;
+  }
+  pg->ref++;
+  release(&pcache.lock);
+
+  r = either_copyout(user_dst, dst, (char*)pg->pa + (off - pg->off), n);
+
+  acquire(&pcache.lock);
+  pg->ref--;
+  release(&pcache.lock);
+  return r < 0 ? -1 : 1;
+}
+
+// Update the cached copy of ip at offset off, if any, with
+// n bytes of kernel memory at src, which writei() has just
+// written to the buffer cache.  The range must not cross a
+// page boundary.  Caller must hold ip->lock.
+void
+pcache_write(struct inode *ip, uint off, char *src, uint n)
+{
+  struct pcpage *pg;
+
+  acquire(&pcache.lock);
+  if((pg = pcache_lookup(ip->dev, ip->inum, PGROUNDDOWN(off))) == 0){
+    release(&pcache.lock);
+    return;
+  }
+  pg->ref++;
+  release(&pcache.lock);
+
+  memmove((char*)pg->pa + (off - pg->off), src, n);
+
+  acquire(&pcache.lock);
+  pg->ref--;
+  release(&pcache.lock);
+}
+
+// Detach every cached page of ip.  Pages that are still
+// mapped keep their frames until the last reference is
+// dropped, but are no longer found by lookups; after that
+// the slot and its frame are reused like any other.
+// Caller must hold ip->lock.
+void
+pcache_inval(struct inode *ip)
+{
+  struct pcpage *pg;
+  int ndirty = 0;
+
+  acquire(&pcache.lock);
+  for(pg = pcache.page; pg < pcache.page+NPCACHE; pg++){
+    if(pg->valid && pg->dev == ip->dev && pg->inum == ip->inum){
+      pcache_unhash(pg);
+      if(pg->dirty){
+        pg->dirty = 0;
+        pg->ip = 0;
+        ndirty++;
+      }
+    }
+  }
+  release(&pcache.lock);
+
+  // the caller holds its own reference, so these
+  // never free the inode.
+  while(ndirty-- > 0)
+    iput(ip);
+}
+
+// Detach the cached pages of ip that overlap [off, off+len)
+// and that nothing maps, so that they are read from the file
+// again. Returns -1, detaching none, if one of them is dirty.
+int
+pcache_drop(struct inode *ip, uint off, uint len)
+{
+  struct pcpage *pg;
+
+  acquire(&pcache.lock);
+  for(pg = pcache.page; pg < pcache.page+NPCACHE; pg++){
+    if(pg->valid && pg->dirty && pg->dev == ip->dev && pg->inum == ip->inum &&
+       pg->off + PGSIZE > off && pg->off < off + len){
+      release(&pcache.lock);
+      return -1;
+    }
+  }
+  for(pg = pcache.page; pg < pcache.page+NPCACHE; pg++){
+    if(pg->valid && pg->ref == 0 && pg->dev == ip->dev && pg->inum == ip->inum &&
+       pg->off + PGSIZE > off && pg->off < off + len)
+      pcache_unhash(pg);
+  }
+  release(&pcache.lock);
+  return 0;
+}
+
+// Free the frames of all unreferenced pages,
+// when kalloc() runs out of memory.
+void
+pcache_shrink(void)
+{
+  struct pcpage *pg;
+
+  acquire(&pcache.lock);
+  for(pg = pcache.page; pg < pcache.page+NPCACHE; pg++){
+    if(pg->ref == 0 && !pg->dirty && pg->pa){
+      if(pg->valid)
+        pcache_unhash(pg);
+      pcache.slot[(pg->pa - KERNBASE) / PGSIZE] = 0;
+      kfree((void*)pg->pa);
+      pg->pa = 0;
+    }
+  }
+  release(&pcache.lock);
+}
+
+// Mark the cached frame pa, mapped shared from ip, dirty.
+// A dirty page holds a reference to ip until written back,
+// so the inode outlives the mapping if need be.
+void
+pcache_setdirty(uint64 pa, struct inode *ip)
+{
+  struct pcpage *pg;
+
+  acquire(&pcache.lock);
+  if((pg = pcache_findpa(pa)) == 0)
+    panic("pcache_setdirty");
+  if(pg->valid && !pg->dirty){
+    pg->dirty = 1;
+    pg->ip = idup(ip);
+  }
+  release(&pcache.lock);
+}
+
+// Write one dirty page back to its file, one bounded log
+// transaction at a time, the way filewrite() splits writes.
+// The caller holds a reference to pg.
+static void
+pcache_flushpage(struct pcpage *pg)
+{
+  struct inode *ip, *owned = 0;
+  int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+  uint i, n;
+
+  acquire(&pcache.lock);
+  if(!pg->dirty){
+    release(&pcache.lock);
+    return;
+  }
+  ip = idup(pg->ip);
+  release(&pcache.lock);
+
+  for(i = 0; i < PGSIZE; i += n){
+    n = PGSIZE - i;
+    if(n > max)
+      n = max;
+    begin_op();
+    ilock(ip);
+    if(i == 0){
+      // stores from now on set PTE_D again and get
+      // picked up by a later scan.
+      acquire(&pcache.lock);
+      if(pg->dirty && pg->ip == ip){
+        owned = pg->ip;
+        pg->dirty = 0;
+        pg->ip = 0;
+      }
+      release(&pcache.lock);
+    }
+    if(owned == 0 || pg->off + i >= ip->size){
+      iunlock(ip);
+      end_op();
+      break;
+    }
+    if(pg->off + i + n > ip->size)
+      n = ip->size - (pg->off + i);
+    writei(ip, 0, pg->pa + i, pg->off + i, n);
+    iunlock(ip);
+    end_op();
+  }
+
+  begin_op();
+  iput(ip);
+  if(owned)
+    iput(owned);
+  end_op();
+}
+
+// Write back every dirty page of ip that overlaps
+// [off, off+len), before returning.
+void
+pcache_sync(struct inode *ip, uint off, uint len)
+{
+  struct pcpage *pg;
+
+  for(;;){
+    acquire(&pcache.lock);
+    for(pg = pcache.page; pg < pcache.page+NPCACHE; pg++)
+      if(pg->dirty && pg->dev == ip->dev && pg->inum == ip->inum &&
+         pg->off + PGSIZE > off && pg->off < off + len)
+        break;
+    if(pg == pcache.page+NPCACHE){
+      release(&pcache.lock);
+      return;
+    }
+    pg->ref++;
+    release(&pcache.lock);
+
+    pcache_flushpage(pg);
+
+    acquire(&pcache.lock);
+    pg->ref--;
+    release(&pcache.lock);
+  }
+}
+
+// Write back up to NFLUSH dirty pages, sorted by file and
+// offset. Returns the number of pages in the batch.
+static int
+pcache_flushbatch(void)
+{
+  struct pcpage *batch[NFLUSH], *pg;
+  int i, j, n = 0;
+
+  acquire(&pcache.lock);
+  for(pg = pcache.page; pg < pcache.page+NPCACHE && n < NFLUSH; pg++){
+    if(!pg->dirty)
+      continue;
+    pg->ref++;
+    for(j = n++; j > 0; j--){
+      if(batch[j-1]->inum < pg->inum ||
+         (batch[j-1]->inum == pg->inum && batch[j-1]->off < pg->off))
+        break;
+      batch[j] = batch[j-1];
+    }
+    batch[j] = pg;
+  }
+  release(&pcache.lock);
+
+  for(i = 0; i < n; i++)
+    pcache_flushpage(batch[i]);
+
+  acquire(&pcache.lock);
+  for(i = 0; i < n; i++)
+    batch[i]->ref--;
+  release(&pcache.lock);
+  return n;
+}
+
+extern struct proc proc[NPROC];
+extern pte_t *walk(pagetable_t pagetable, uint64 va, int alloc);
+
+// A dirty private frame of a shared mapping, found by
+// pcache_harvest(), with references to the frame and the inode.
+struct pcpriv {
+  struct inode *ip;
+  uint off;
+  uint64 pa;
+};
+
+// Collect the dirty bits of the shared mappings of sleeping
+// processes, which take no timer interrupts to do it themselves.
+// Cached pages are marked dirty here. Up to n private frames,
+// which the cache had no room for, go in priv[] for the caller
+// to write back; returns how many. Others keep their dirty bits
+// for the next call.
+static int
+pcache_harvest(struct pcpriv *priv, int n)
+{
+  struct proc *p;
+  struct vma *vma;
+  struct pcpage *pg;
+  pte_t *pte;
+  uint64 a;
+  int i, k = 0;
+
+  // pcache.lock comes before p->lock, as in sleep() and wakeup()
+  // under it. Holding p->lock keeps p asleep, and a process only
+  // sleeps with its page table and vmas_ in order. Its TLB
+  // entries go when it next runs, with the satp switch.
+  acquire(&pcache.lock);
+  for(p = proc; p < &proc[NPROC]; p++){
+    acquire(&p->lock);
+    if(p->state != SLEEPING || p->pagetable == 0){
+      release(&p->lock);
+      continue;
+    }
+    for(i = 0; i < 16; i++){
+      vma = &p->vmas_[i];
+      if(!vma->valid_ || vma->file_ == 0 || !(vma->flags_ & MAP_SHARED) ||
+         !(vma->prot_ & PROT_WRITE))
+        continue;
+      for(a = vma->va_; a < vma->va_ + vma->len_; a += PGSIZE){
+        pte = walk(p->pagetable, a, 0);
+        if(pte == 0 || !(*pte & PTE_V) || !(*pte & PTE_D))
+          continue;
+        if(*pte & PTE_PC){
+          if((pg = pcache_findpa(PTE2PA(*pte))) == 0)
+            panic("pcache_harvest");
+          if(pg->valid && !pg->dirty){
+            pg->dirty = 1;
+            pg->ip = idup(vma->file_->ip);
+          }
+        } else if(k < n){
+          // p may free the frame as soon as it runs.
+          priv[k].ip = idup(vma->file_->ip);
+          priv[k].off = vma->offset_ + (a - vma->va_);
+          priv[k].pa = (uint64)krealloc((void*)PTE2PA(*pte));
+          k++;
+        } else {
+          continue;
+        }
+        *pte &= ~PTE_D;
+      }
+    }
+    release(&p->lock);
+  }
+  release(&pcache.lock);
+  return k;
+}
+
+// Ask the flusher to run without waiting for its next tick.
+void
+pcache_kick(void)
+{
+  pcache.kick = 1;
+}
+
+// The pcflush kernel thread. Every FLUSHTICKS ticks, or
+// sooner when kicked, collects the dirty bits of sleeping
+// processes and writes dirty pages back in batches.
+void
+pcache_flusher(void)
+{
+  struct pcpriv priv[NFLUSH];
+  uint t0;
+  int n;
+
+  // Still holding p->lock from scheduler.
+  release(&myproc()->lock);
+
+  for(;;){
+    acquire(&tickslock);
+    t0 = ticks;
+    while(!pcache.kick && ticks - t0 < FLUSHTICKS)
+      sleep(&ticks, &tickslock);
+    release(&tickslock);
+    pcache.kick = 0;
+
+    do {
+      n = pcache_harvest(priv, NFLUSH);
+      for(int i = 0; i < n; i++){
+        mmapwriteback(priv[i].ip, priv[i].off, priv[i].pa);
+        kfree((void*)priv[i].pa);
+        begin_op();
+        iput(priv[i].ip);
+        end_op();
+      }
+    } while(n == NFLUSH);
+
+    // bounded, so pages that keep getting dirtied
+    // cannot keep the flusher busy forever.
+    for(int i = 0; i < NPCACHE / NFLUSH; i++)
+      if(pcache_flushbatch() < NFLUSH)
+        break;
+  }
+}
+
+// Queue npages pages of ip starting at offset off to be read
+// into the cache by the prefetcher. This is only a hint: the
+// request is dropped when the queue is full.
+void
+pcache_prefetch(struct inode *ip, uint off, uint npages)
+{
+  struct pcfetch *f;
+
+  if(npages == 0)
+    return;
+  if(npages > NPCACHE / 4)
+    npages = NPCACHE / 4;
+  acquire(&pcache.lock);
+  if(pcache.fetchw - pcache.fetchr < NPREFETCH){
+    f = &pcache.fetch[pcache.fetchw++ % NPREFETCH];
+    f->ip = idup(ip);
+    f->off = PGROUNDDOWN(off);
+    f->npages = npages;
+    wakeup(&pcache.fetchr);
+  }
+  release(&pcache.lock);
+}
+
+// The pcfetch kernel thread. Reads queued pages into the
+// cache, so the faults that follow find them there.
+void
+pcache_prefetcher(void)
+{
+  struct pcfetch f;
+  uint64 pa;
+
+  // Still holding p->lock from scheduler.
+  release(&myproc()->lock);
+
+  for(;;){
+    acquire(&pcache.lock);
+    while(pcache.fetchr == pcache.fetchw)
+      sleep(&pcache.fetchr, &pcache.lock);
+    f = pcache.fetch[pcache.fetchr++ % NPREFETCH];
+    release(&pcache.lock);
+
+    for(uint i = 0; i < f.npages; i++){
+      ilock(f.ip);
+      if(f.off + i*PGSIZE >= f.ip->size){
+        iunlock(f.ip);
+        break;
+      }
+      pa = pcache_get(f.ip, f.off + i*PGSIZE);
+      iunlock(f.ip);
+      if(pa == 0)
+        break;
+      pcache_put(pa);
+    }
+
+    begin_op();
+    iput(f.ip);
+    end_op();
+  }
+}
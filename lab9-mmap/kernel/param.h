@@ -15,5 +15,13 @@
 #define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
 #define FSSIZE       1000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
+#define NPCACHE      256   // size of file page cache, in pages
+#define NPCHASH      61    // page cache hash buckets (prime)
+#define NFLUSH       8     // dirty pages per page cache write-back batch
+#define FLUSHTICKS   10    // ticks between mmap dirty-bit scans
+#define FAULTAROUND  4     // cached pages mapped per mmap fault
+#define READAHEAD    16    // mmap read-ahead window, MADV_SEQUENTIAL
+#define NPREFETCH    8     // queued page cache prefetch requests
+#define NSEG         4     // demand-loaded program segments per process
 
 #endif // PARAM_H
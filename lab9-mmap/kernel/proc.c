@@ -143,6 +143,8 @@ found:
 
   // set all vmas of the process to be invalid
   memset(&p->vmas_, 0, sizeof(p->vmas_));
+  p->exe_ = 0;
+  memset(&p->segs_, 0, sizeof(p->segs_));
 
   return p;
 }
@@ -250,6 +252,23 @@ userinit(void)
   release(&p->lock);
 }
 
+// Start a kernel thread that runs fn in its own process.
+// fn is entered the way forkret() is, still holding p->lock
+// from the scheduler, which it must release first.
+// fn must never return.
+void
+kthread_create(void (*fn)(void), char *name)
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0)
+    panic("kthread_create");
+  p->context.ra = (uint64)fn;
+  safestrcpy(p->name, name, sizeof(p->name));
+  p->state = RUNNABLE;
+  release(&p->lock);
+}
+
 // Grow or shrink user memory by n bytes.
 // Return 0 on success, -1 on failure.
 int
@@ -260,6 +279,11 @@ growproc(int n)
 
   sz = p->sz;
   if(n > 0){
+    // the heap must not run into the mmap regions.
+    for(int i = 0; i < 16; i++){
+      if(p->vmas_[i].valid_ && (uint64)sz + n > p->vmas_[i].va_)
+        return -1;
+    }
     if((sz = uvmalloc(p->pagetable, sz, sz + n)) == 0) {
       return -1;
     }
@@ -286,14 +310,6 @@ fork(void)
     return -1;
   }
 
-  // copy vmas
-  memmove((void *)(np->vmas_), (void *)(p->vmas_), sizeof(p->vmas_));
-  for (int i = 0; i < 16; ++i) {
-    if (np->vmas_[i].valid_) {
-      filedup(np->vmas_[i].file_);
-    }
-  }
-
   // Copy user memory from parent to child.
   if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
     freeproc(np);
@@ -302,6 +318,22 @@ fork(void)
   }
   np->sz = p->sz;
 
+  // copy vmas
+  for (i = 0; i < 16; ++i) {
+    if (p->vmas_[i].valid_) {
+      np->vmas_[i] = p->vmas_[i];
+      if (np->vmas_[i].file_) {
+        filedup(np->vmas_[i].file_);
+      }
+      if (vmacopy(&(np->vmas_[i]), p->pagetable, np->pagetable) < 0) {
+        munmapall(np, np->pagetable);
+        freeproc(np);
+        release(&np->lock);
+        return -1;
+      }
+    }
+  }
+
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
 
@@ -313,6 +345,9 @@ fork(void)
     if(p->ofile[i])
       np->ofile[i] = filedup(p->ofile[i]);
   np->cwd = idup(p->cwd);
+  if(p->exe_)
+    np->exe_ = idup(p->exe_);
+  memmove(np->segs_, p->segs_, sizeof(p->segs_));
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
@@ -346,8 +381,6 @@ reparent(struct proc *p)
   }
 }
 
-extern uint64 
-munmap(struct vma *vma, pagetable_t pgtbl, uint64 addr, uint64 len);
 // Exit the current process.  Does not return.
 // An exited process remains in the zombie state
 // until its parent calls wait().
@@ -359,11 +392,8 @@ exit(int status)
   if(p == initproc)
     panic("init exiting");
 
-  // release all vmas  
-  for (int i = 0; i < 16; ++i) {
-    struct vma *vma = &(p->vmas_[i]);
-    munmap(vma, p->pagetable, vma->va_, vma->len_); 
-  }
+  // release all vmas
+  munmapall(p, p->pagetable);
 
   // Close all open files.
   for(int fd = 0; fd < NOFILE; fd++){
@@ -376,8 +406,11 @@ exit(int status)
 
   begin_op();
   iput(p->cwd);
+  if(p->exe_)
+    iput(p->exe_);
   end_op();
   p->cwd = 0;
+  p->exe_ = 0;
 
   acquire(&wait_lock);
 
@@ -408,6 +441,11 @@ wait(uint64 addr)
   int havekids, pid;
   struct proc *p = myproc();
 
+  // the copyout() of xstate below happens under np->lock, where
+  // it can't fault in a page that exec() left for later.
+  if(addr != 0)
+    uvmprefault(addr, sizeof(int), 1);
+
   acquire(&wait_lock);
 
   for(;;){
@@ -102,6 +102,22 @@ struct vma {
   uint offset_;
   // is vma valid?
   uint valid_;
+  // madvise() access pattern hint
+  int advice_;
+};
+
+// A program segment that exec() left to be loaded on demand
+// from the executable, p->exe_.
+struct seg {
+  // virtual address, page-aligned
+  uint64 va_;
+  // bytes read from the file, at offset_
+  uint filesz_;
+  uint offset_;
+  // bytes in memory; past filesz_ they are zero
+  uint memsz_;
+  // PTE permission bits
+  int perm_;
 };
 
 /**
@@ -136,6 +152,9 @@ struct proc {
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
   struct vma vmas_[16];        // memory-mapped file
+  uint flushed_;               // ticks at last dirty-bit scan of vmas_
+  struct inode *exe_;          // executable, for segs_
+  struct seg segs_[NSEG];      // demand-loaded program segments
 };
 
 #endif // PROC_H
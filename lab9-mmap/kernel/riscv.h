@@ -347,6 +347,10 @@ sfence_vma()
 #define PTE_W (1L << 2)
 #define PTE_X (1L << 3)
 #define PTE_U (1L << 4) // 1 -> user can access
+#define PTE_A (1L << 6) // accessed, set by hardware
+#define PTE_D (1L << 7) // dirty, set by hardware on store
+#define PTE_PC (1L << 8) // RSW: frame belongs to the page cache
+#define PTE_Z (1L << 9)  // RSW: not present, zero-fill on demand
 
 // shift a physical address to the right place for a PTE.
 #define PA2PTE(pa) ((((uint64)pa) >> 12) << 10)
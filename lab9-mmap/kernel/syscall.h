@@ -26,5 +26,7 @@
 #define SYS_close  21
 #define SYS_mmap   22
 #define SYS_munmap 23
+#define SYS_msync  24
+#define SYS_madvise 25
 
 #endif // SYSCALL_H
@@ -6,6 +6,7 @@
 
 #include "types.h"
 #include "riscv.h"
+#include "memlayout.h"
 #include "defs.h"
 #include "param.h"
 #include "stat.h"
@@ -37,6 +38,33 @@ argfd(int n, int *pfd, struct file **pf)
 
 extern void
 safe_uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free);
+extern pte_t *walk(pagetable_t pagetable, uint64 va, int alloc);
+
+// Find room for len bytes of mappings, top-down from MMAPTOP:
+// just below the lowest mapping that is in the way, and above
+// the heap, so that mmap() and sbrk() never collide.
+// Returns 0 if there is no room.
+static uint64
+vma_place(struct proc *p, uint64 len)
+{
+  uint64 end = MMAPTOP;
+  int moved = 1;
+
+  while (moved) {
+    moved = 0;
+    if (end < len || end - len < PGROUNDUP(p->sz)) {
+      return 0;
+    }
+    for (int i = 0; i < 16; ++i) {
+      struct vma *v = &(p->vmas_[i]);
+      if (v->valid_ && v->va_ < end && v->va_ + v->len_ > end - len) {
+        end = v->va_;
+        moved = 1;
+      }
+    }
+  }
+  return end - len;
+}
 
 // notice that len is page aligned in mmaptest, 
 // and offset is always zero,
@@ -64,23 +92,32 @@ sys_mmap(void) {
     return -1;
   }
 
-  struct file *fobj;
-  if (argfd(4, 0, &fobj) < 0) {
+  if (!(flags & MAP_SHARED) == !(flags & MAP_PRIVATE)) {
     return -1;
   }
-  if (fobj->type == 0) {
-    panic("sys_mmap");
-  }
-  filedup(fobj);
 
   int offset;
   if (argint(5, &offset) < 0) {
     return -1;
   }
 
-  if (!fobj->writable && (prot & PROT_WRITE) && !(flags & MAP_PRIVATE)) {
-    // fobj is read-only.
-    return -1;
+  // anonymous memory ignores the file descriptor.
+  struct file *fobj = 0;
+  if (flags & MAP_ANONYMOUS) {
+    if (offset != 0) {
+      return -1;
+    }
+  } else {
+    if (argfd(4, 0, &fobj) < 0) {
+      return -1;
+    }
+    if (fobj->type != FD_INODE) {
+      return -1;
+    }
+    if (!fobj->writable && (prot & PROT_WRITE) && !(flags & MAP_PRIVATE)) {
+      // fobj is read-only.
+      return -1;
+    }
   }
 
   // find an empty vma slot
@@ -97,20 +134,103 @@ sys_mmap(void) {
     return -1;
   }
 
+  // find an unused region
+  len = PGROUNDUP(len);
+  uint64 va = vma_place(p, len);
+  if (len == 0 || va == 0) {
+    return -1;
+  }
+
   vma->flags_ = flags;
   vma->prot_ = prot;
-  vma->file_ = fobj;
+  vma->file_ = fobj ? filedup(fobj) : 0;
   vma->offset_ = offset;
-
-  // find an unused region
-  vma->va_ = p->sz;
-  vma->len_ = len;
+  vma->va_ = va;
+  vma->len_ = len;  // lazy allocation
   vma->valid_ = 1;
-
-  p->sz += len;  // lazy allocation
+  vma->advice_ = MADV_NORMAL;
   return vma->va_;
 }
 
+// Write the page at file offset off of ip, whose frame is pa,
+// back to the file. Bytes past the end of the file are dropped,
+// since stores through a mapping never extend the file.
+void
+mmapwriteback(struct inode *ip, uint off, uint64 pa)
+{
+  // same limit as filewrite(): a page spans several transactions.
+  int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+  int n;
+
+  for (int i = 0; i < PGSIZE; i += n) {
+    n = PGSIZE - i;
+    if (n > max)
+      n = max;
+    begin_op();
+    ilock(ip);
+    if (off + i >= ip->size) {
+      iunlock(ip);
+      end_op();
+      break;
+    }
+    if (off + i + n > ip->size)
+      n = ip->size - (off + i);
+    writei(ip, 0, pa + i, off + i, n);
+    iunlock(ip);
+    end_op();
+  }
+}
+
+// Write the page at va of a shared mapping, whose frame is pa,
+// back to its file.
+static void
+vma_writeback(struct vma *vma, uint64 va, uint64 pa)
+{
+  mmapwriteback(vma->file_->ip, vma->offset_ + (va - vma->va_), pa);
+}
+
+// Move the hardware dirty bits of the pages in [addr, addr+len)
+// of a shared writable mapping into the page cache, which writes
+// them back in the background. A page the cache had no room for
+// is a private frame and is written back right away.
+static void
+vma_harvest(struct vma *vma, pagetable_t pgtbl, uint64 addr, uint64 len)
+{
+  int cleared = 0;
+
+  if (vma->file_ == 0 || !(vma->flags_ & MAP_SHARED) || !(vma->prot_ & PROT_WRITE)) {
+    return;
+  }
+  for (uint64 a = addr; a < addr + len; a += PGSIZE) {
+    pte_t *pte = walk(pgtbl, a, 0);
+    if (pte == 0 || !(*pte & PTE_V) || !(*pte & PTE_D)) {
+      continue;
+    }
+    *pte &= ~PTE_D;
+    cleared = 1;
+    if (*pte & PTE_PC) {
+      pcache_setdirty(PTE2PA(*pte), vma->file_->ip);
+    } else {
+      vma_writeback(vma, a, PTE2PA(*pte));
+    }
+  }
+  if (cleared) {
+    sfence_vma();
+  }
+}
+
+// Collect the dirty bits of all of p's shared mappings.
+// Called from p's own timer interrupts, every FLUSHTICKS.
+void
+mmapharvest(struct proc *p)
+{
+  for (int i = 0; i < 16; ++i) {
+    if (p->vmas_[i].valid_) {
+      vma_harvest(&(p->vmas_[i]), p->pagetable, p->vmas_[i].va_, p->vmas_[i].len_);
+    }
+  }
+}
+
 // notice that len is page aligned in mmaptest, 
 // so we can make some safe optimizations.
 uint64 
@@ -123,27 +243,99 @@ munmap(struct vma *vma, pagetable_t pgtbl, uint64 addr, uint64 len) {
     // bad length
     return -1;
   }
-
-  // write back for persistence
-  if (vma->flags_ & MAP_SHARED && vma->prot_ & PROT_WRITE) {
-    filewrite(vma->file_, addr, len);
+  if (addr != vma->va_ && addr + len != vma->va_ + vma->len_) {
+    // cannot punch a hole in the middle
+    return -1;
   }
 
-  // unmap the memory pages
+  // the pages that were stored to are written back
+  // later by the flusher, not here.
+  vma_harvest(vma, pgtbl, addr, len);
   for (uint64 a = addr; a < addr + len; a += PGSIZE) {
+    pte_t *pte = walk(pgtbl, a, 0);
+    if (pte == 0 || !(*pte & PTE_V)) {
+      continue;
+    }
     safe_uvmunmap(pgtbl, a, 1U, 1);
   }
-  vma->va_ += len;
+
+  if (addr == vma->va_) {
+    vma->va_ += len;
+    vma->offset_ += len;
+  }
   vma->len_ -= len;
   // if freeing entire file
   if (vma->len_ == 0) {
-    vma->file_->ref--;
+    if (vma->file_) {
+      fileclose(vma->file_);
+    }
     vma->valid_ = 0;
   }
 
   return (uint64)0;
 }
 
+// Unmap all of p's memory-mapped regions from pgtbl.
+void
+munmapall(struct proc *p, pagetable_t pgtbl)
+{
+  for (int i = 0; i < 16; ++i) {
+    struct vma *vma = &(p->vmas_[i]);
+    if (vma->valid_) {
+      munmap(vma, pgtbl, vma->va_, vma->len_);
+    }
+  }
+}
+
+// Copy the pages of vma from old into new, for fork().
+// Pages from the page cache, and pages of shared mappings,
+// are shared; other private pages become copy-on-write in
+// both processes. A shared anonymous mapping is filled in
+// completely first, so that parent and child keep seeing
+// the same pages later on. Called in the parent.
+int
+vmacopy(struct vma *vma, pagetable_t old, pagetable_t new)
+{
+  int cow = 0;
+
+  for (uint64 a = vma->va_; a < vma->va_ + vma->len_; a += PGSIZE) {
+    pte_t *pte = walk(old, a, 0);
+    if ((pte == 0 || !(*pte & PTE_V)) && vma->file_ == 0 && (vma->flags_ & MAP_SHARED)) {
+      if (pagefault(a, !(vma->prot_ & PROT_READ)) < 0) {
+        return -1;
+      }
+      pte = walk(old, a, 0);
+    }
+    if (pte == 0 || !(*pte & PTE_V)) {
+      continue;
+    }
+
+    uint64 pa = PTE2PA(*pte);
+    // the child has not stored to anything yet.
+    int flags = PTE_FLAGS(*pte) & ~PTE_D;
+    if (flags & PTE_PC) {
+      if (mappages(new, a, PGSIZE, pa, flags) != 0) {
+        return -1;
+      }
+      pcache_dup(pa);
+      continue;
+    }
+    if ((vma->flags_ & MAP_PRIVATE) && (flags & PTE_W)) {
+      *pte &= ~PTE_W;
+      flags &= ~PTE_W;
+      cow = 1;
+    }
+    if (mappages(new, a, PGSIZE, pa, flags) != 0) {
+      return -1;
+    }
+    krealloc((void *)pa);
+  }
+  if (cow) {
+    sfence_vma();
+  }
+  return 0;
+}
+
 uint64
 sys_munmap(void) {
   uint64 addr;
@@ -163,6 +355,136 @@ sys_munmap(void) {
   return munmap(vma, p->pagetable, addr, len);
 }
 
+uint64
+sys_msync(void) {
+  uint64 addr;
+  uint64 len;
+  int flags;
+  if (argaddr(0, &addr) < 0) { return -1; }
+  if (argaddr(1, &len) < 0) { return -1; }
+  if (argint(2, &flags) < 0) { return -1; }
+  if ((addr % PGSIZE) != 0 || (flags & ~(MS_ASYNC|MS_SYNC|MS_INVALIDATE)) != 0
+   || (flags & (MS_ASYNC|MS_SYNC)) == (MS_ASYNC|MS_SYNC)) {
+    return -1;
+  }
+
+  struct proc *p = myproc();
+  struct vma *vma = 0;
+  for (int i = 0; i < 16; ++i) {
+    if (p->vmas_[i].valid_ && in_vma(&(p->vmas_[i]), addr)) {
+      vma = &(p->vmas_[i]);
+      break;
+    }
+  }
+  if (vma == 0 || addr + len > vma->va_ + vma->len_) {
+    return -1;
+  }
+
+  len = PGROUNDUP(len);
+  vma_harvest(vma, p->pagetable, addr, len);
+  if (vma->file_ == 0 || !(vma->flags_ & MAP_SHARED)) {
+    return 0;
+  }
+  if (flags & MS_SYNC) {
+    pcache_sync(vma->file_->ip, vma->offset_ + (addr - vma->va_), len);
+  } else {
+    pcache_kick();
+  }
+  if (flags & MS_INVALIDATE) {
+    // unmap the range, so it faults the file's pages in again,
+    // and drop them from the cache unless others map them. The
+    // private frames among them were written back just now.
+    for (uint64 a = addr; a < addr + len; a += PGSIZE) {
+      pte_t *pte = walk(p->pagetable, a, 0);
+      if (pte != 0 && (*pte & PTE_V)) {
+        safe_uvmunmap(p->pagetable, a, 1U, 1);
+      }
+    }
+    sfence_vma();
+    return pcache_drop(vma->file_->ip, vma->offset_ + (addr - vma->va_), len);
+  }
+  return 0;
+}
+
+uint64
+sys_madvise(void) {
+  uint64 addr;
+  uint64 len;
+  int advice;
+  if (argaddr(0, &addr) < 0) { return -1; }
+  if (argaddr(1, &len) < 0) { return -1; }
+  if (argint(2, &advice) < 0) { return -1; }
+  if ((addr % PGSIZE) != 0 || advice < MADV_NORMAL || advice > MADV_DONTNEED) {
+    return -1;
+  }
+  len = PGROUNDUP(len);
+  if (addr + len < addr) {
+    return -1;
+  }
+
+  struct proc *p = myproc();
+  struct vma *vma = 0;
+  for (int i = 0; i < 16; ++i) {
+    if (!p->vmas_[i].valid_) {
+      continue;
+    }
+    if (in_vma(&(p->vmas_[i]), addr)) {
+      vma = &(p->vmas_[i]);
+      break;
+    }
+    if (addr < p->vmas_[i].va_ && addr + len > p->vmas_[i].va_) {
+      // a heap range must not run into a mapping
+      return -1;
+    }
+  }
+
+  if (vma != 0) {
+    // the hints apply to the whole mapping.
+    if (addr + len > vma->va_ + vma->len_) {
+      return -1;
+    }
+    if (advice == MADV_WILLNEED) {
+      if (vma->file_ == 0) {
+        return 0;
+      }
+      pcache_prefetch(vma->file_->ip, vma->offset_ + (addr - vma->va_), len / PGSIZE);
+    } else if (advice == MADV_DONTNEED) {
+      // stores to shared pages still reach the file; private
+      // copies are dropped and read the file again, and
+      // anonymous pages read as zero.
+      vma_harvest(vma, p->pagetable, addr, len);
+      for (uint64 a = addr; a < addr + len; a += PGSIZE) {
+        pte_t *pte = walk(p->pagetable, a, 0);
+        if (pte != 0 && (*pte & PTE_V)) {
+          safe_uvmunmap(p->pagetable, a, 1U, 1);
+        }
+      }
+      sfence_vma();
+    } else {
+      vma->advice_ = advice;
+    }
+    return 0;
+  }
+
+  // heap, or any other memory below p->sz
+  if (addr + len > p->sz) {
+    return -1;
+  }
+  if (advice == MADV_DONTNEED) {
+    for (uint64 a = addr; a < addr + len; a += PGSIZE) {
+      pte_t *pte = walk(p->pagetable, a, 0);
+      // leave the stack guard page alone.
+      if (pte == 0 || !(*pte & PTE_V) || !(*pte & PTE_U)) {
+        continue;
+      }
+      safe_uvmunmap(p->pagetable, a, 1U, 1);
+      *pte = PTE_Z;
+    }
+    sfence_vma();
+  }
+  return 0;
+}
+
 // Allocate a file descriptor for the given file.
 // Takes over file reference from caller on success.
 static int
@@ -203,6 +525,8 @@ sys_read(void)
 
   if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argaddr(1, &p) < 0)
     return -1;
+  if(f->type != FD_INODE && n > 0)
+    uvmprefault(p, n, 1);
   return fileread(f, p, n);
 }
 
@@ -215,6 +539,8 @@ sys_write(void)
 
   if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argaddr(1, &p) < 0)
     return -1;
+  if(f->type != FD_INODE && n > 0)
+    uvmprefault(p, n, 0);
 
   return filewrite(f, p, n);
 }
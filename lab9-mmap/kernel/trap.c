@@ -34,6 +34,329 @@ trapinithart(void)
 
 extern pte_t *walk(pagetable_t pagetable, uint64 va, int alloc);
 
+// Map a private copy of the page at pa to va, writable.
+static int
+mapcopy(pagetable_t pagetable, uint64 va, uint64 pa, int perm)
+{
+  char *mem;
+
+  if ((mem = kalloc()) == 0) {
+    pcache_shrink();
+    if ((mem = kalloc()) == 0)
+      return -1;
+  }
+  memmove(mem, (void *)pa, PGSIZE);
+  if (mappages(pagetable, va, PGSIZE, (uint64)mem, perm | PTE_W) != 0) {
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Map a fresh zeroed frame at va.
+static int
+mapzero(pagetable_t pagetable, uint64 va, int perm)
+{
+  char *mem;
+
+  if ((mem = kalloc()) == 0) {
+    pcache_shrink();
+    if ((mem = kalloc()) == 0)
+      return -1;
+  }
+  memset(mem, 0, PGSIZE);
+  if (mappages(pagetable, va, PGSIZE, (uint64)mem, perm) != 0) {
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Replace the page cache frame that *pte maps at va with a
+// private copy, writable, for the first store to it.
+static int
+pccopy(pagetable_t pagetable, pte_t *pte, uint64 va, int perm)
+{
+  pte_t old = *pte;
+  uint64 pa = PTE2PA(old);
+
+  *pte = 0;
+  if (mapcopy(pagetable, va, pa, perm) != 0) {
+    *pte = old;
+    return -1;
+  }
+  sfence_vma();
+  pcache_put(pa);
+  return 0;
+}
+
+// Map page va of program segment sg. A page that holds only
+// file contents comes straight from the page cache, so every
+// process running the executable shares it; in a writable
+// segment it is mapped read-only until the first store.
+// Other pages get a frame of their own, and what lies past
+// the segment's file contents reads as zero.
+static int
+segfault(struct proc *p, struct seg *sg, uint64 va)
+{
+  struct inode *ip = p->exe_;
+  uint64 a = va - sg->va_, pa = 0;
+  uint n;
+  char *mem;
+  int shared, locked, r;
+
+  shared = (sg->offset_ % PGSIZE) == 0 &&
+    (a + PGSIZE <= sg->filesz_ ||
+     (sg->filesz_ == sg->memsz_ && !(sg->perm_ & PTE_W)));
+
+  if (!(locked = holdingsleep(&ip->lock))) {
+    ilock(ip);
+  }
+  if (shared && (pa = pcache_get(ip, sg->offset_ + a)) == 0) {
+    pcache_shrink();
+    pa = pcache_get(ip, sg->offset_ + a);
+  }
+  if (pa != 0) {
+    if (!locked) {
+      iunlock(ip);
+    }
+    if (mappages(p->pagetable, va, PGSIZE, pa, (sg->perm_ & ~PTE_W) | PTE_PC) != 0) {
+      pcache_put(pa);
+      return -1;
+    }
+    return 0;
+  }
+
+  r = n = 0;
+  if ((mem = kalloc()) == 0) {
+    pcache_shrink();
+    mem = kalloc();
+  }
+  if (mem != 0) {
+    memset(mem, 0, PGSIZE);
+    if (a < sg->filesz_) {
+      n = sg->filesz_ - a < PGSIZE ? sg->filesz_ - a : PGSIZE;
+      r = readi(ip, 0, (uint64)mem, sg->offset_ + a, n);
+    }
+  }
+  if (!locked) {
+    iunlock(ip);
+  }
+  if (mem == 0) {
+    return -1;
+  }
+  if (r != n || mappages(p->pagetable, va, PGSIZE, (uint64)mem, sg->perm_) != 0) {
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Pages below p->sz that are not present yet are marked PTE_Z:
+// those of the program segments exec() left behind are read in
+// from the executable; others, heap pages dropped by
+// madvise(MADV_DONTNEED), get a fresh zeroed frame.
+static int
+lazyfault(struct proc *p, uint64 va, int write)
+{
+  struct seg *sg = 0;
+  pte_t *pte;
+
+  // walk() panics on addresses past MAXVA.
+  if (va >= p->sz || va >= MAXVA) {
+    return -1;
+  }
+  if ((pte = walk(p->pagetable, va, 0)) == 0) {
+    return -1;
+  }
+  va = PGROUNDDOWN(va);
+  for (int i = 0; i < NSEG; ++i) {
+    if (p->exe_ && p->segs_[i].va_ <= va && va < p->segs_[i].va_ + p->segs_[i].memsz_) {
+      sg = &(p->segs_[i]);
+      break;
+    }
+  }
+
+  if (*pte & PTE_V) {
+    // the first store to a shared page of a writable segment.
+    if (!write || sg == 0 || !(sg->perm_ & PTE_W) ||
+        (*pte & PTE_W) || !(*pte & PTE_PC)) {
+      return -1;
+    }
+    return pccopy(p->pagetable, pte, va, sg->perm_);
+  }
+  if (!(*pte & PTE_Z)) {
+    return -1;
+  }
+  if (sg != 0) {
+    return segfault(p, sg, va);
+  }
+  return mapzero(p->pagetable, va, PTE_W|PTE_X|PTE_R|PTE_U);
+}
+
+// After a fault at va, map the following pages of vma that are
+// already in the page cache too (fault-around), and for
+// MADV_SEQUENTIAL start reading the window after va in the
+// background (read-ahead). MADV_RANDOM does neither.
+static void
+faultaround(struct proc *p, struct vma *vma, uint64 va, int perm)
+{
+  struct inode *ip = vma->file_->ip;
+  uint64 end = vma->va_ + vma->len_;
+  uint64 a, pa;
+  pte_t *pte;
+  int n;
+
+  if (vma->advice_ == MADV_RANDOM) {
+    return;
+  }
+  n = (vma->advice_ == MADV_SEQUENTIAL) ? READAHEAD : FAULTAROUND;
+  for (a = va + PGSIZE; a < va + n*PGSIZE && a < end; a += PGSIZE) {
+    pte = walk(p->pagetable, a, 0);
+    if (pte != 0 && (*pte & PTE_V)) {
+      continue;
+    }
+    if ((pa = pcache_peek(ip, vma->offset_ + (a - vma->va_))) == 0) {
+      continue;
+    }
+    if (mappages(p->pagetable, a, PGSIZE, pa, perm | PTE_PC) != 0) {
+      pcache_put(pa);
+      break;
+    }
+  }
+  if (vma->advice_ == MADV_SEQUENTIAL && va + PGSIZE < end) {
+    n = (end - (va + PGSIZE)) / PGSIZE;
+    pcache_prefetch(ip, vma->offset_ + (va + PGSIZE - vma->va_), n < READAHEAD ? n : READAHEAD);
+  }
+}
+
+// Resolve a page fault at va of the current process; write is
+// set for stores. Outside its memory-mapped regions, only
+// pages of the program that are not loaded yet or still shared
+// with the page cache, or pages dropped by madvise(), can
+// fault.
+// File pages are mapped straight from the page cache, so all
+// processes mapping a file share them. A private writable
+// mapping gets them read-only and copies a page on its first
+// store to it, as it does with pages it shares after fork().
+// Anonymous pages read as zero until first touched.
+// Returns 0 on success, -1 if va is not mapped this way.
+int
+pagefault(uint64 va, int write)
+{
+  struct proc *p = myproc();
+  struct vma *vma = 0;
+  struct inode *ip;
+  pte_t *pte;
+  uint64 pa;
+  uint off;
+  char *mem;
+  int perm, locked, r;
+
+  for (int i = 0; i < 16; ++i) {
+    if (p->vmas_[i].valid_ && in_vma(&(p->vmas_[i]), va)) {
+      vma = &(p->vmas_[i]);
+      break;
+    }
+  }
+  if (vma == 0) {
+    return lazyfault(p, va, write);
+  }
+  if (write ? !(vma->prot_ & PROT_WRITE) : !(vma->prot_ & PROT_READ)) {
+    return -1;
+  }
+
+  va = PGROUNDDOWN(va);
+  perm = PTE_U;
+  if (vma->prot_ & PROT_READ) {
+    perm |= PTE_R;
+  }
+  if (vma->prot_ & PROT_EXEC) {
+    perm |= PTE_X;
+  }
+
+  pte = walk(p->pagetable, va, 0);
+  if (pte != 0 && (*pte & PTE_V)) {
+    // already present: this must be the first store to a
+    // private page that is still shared, with the page
+    // cache or, after fork(), with another process.
+    if (!write || (*pte & PTE_W) || !(vma->flags_ & MAP_PRIVATE)) {
+      return -1;
+    }
+    pa = PTE2PA(*pte);
+    if (!(*pte & PTE_PC)) {
+      if ((mem = kmake_unique((void *)pa)) == 0) {
+        return -1;
+      }
+      *pte = PA2PTE(mem) | perm | PTE_W | PTE_V;
+      sfence_vma();
+      return 0;
+    }
+    return pccopy(p->pagetable, pte, va, perm);
+  }
+
+  if (!(vma->flags_ & MAP_PRIVATE) && (vma->prot_ & PROT_WRITE)) {
+    perm |= PTE_W;
+  }
+  if (vma->file_ == 0) {
+    if (vma->prot_ & PROT_WRITE) {
+      perm |= PTE_W;
+    }
+    return mapzero(p->pagetable, va, perm);
+  }
+
+  // copyin()/copyout() may fault while readi()/writei()
+  // holds the lock of the very inode that is mapped.
+  ip = vma->file_->ip;
+  off = vma->offset_ + (va - vma->va_);
+  if (!(locked = holdingsleep(&ip->lock))) {
+    ilock(ip);
+  }
+  pa = pcache_get(ip, off);
+  if (pa == 0) {
+    pcache_shrink();
+    pa = pcache_get(ip, off);
+  }
+  if (pa == 0) {
+    // the cache is full of mapped or dirty pages: give this
+    // mapping a frame of its own, which vma_harvest() writes
+    // back if it is shared.
+    if ((mem = kalloc()) != 0) {
+      memset(mem, 0, PGSIZE);
+      readi(ip, 0, (uint64)mem, off, PGSIZE);
+    }
+    if (!locked) {
+      iunlock(ip);
+    }
+    if (mem == 0) {
+      return -1;
+    }
+    if (vma->prot_ & PROT_WRITE) {
+      perm |= PTE_W;
+    }
+    if (mappages(p->pagetable, va, PGSIZE, (uint64)mem, perm) != 0) {
+      kfree(mem);
+      return -1;
+    }
+    return 0;
+  }
+  if (!locked) {
+    iunlock(ip);
+  }
+
+  if ((vma->flags_ & MAP_PRIVATE) && write) {
+    r = mapcopy(p->pagetable, va, pa, perm);
+    pcache_put(pa);
+    return r;
+  }
+  if (mappages(p->pagetable, va, PGSIZE, pa, perm | PTE_PC) != 0) {
+    pcache_put(pa);
+    return -1;
+  }
+  faultaround(p, vma, va, perm);
+  return 0;
+}
+
 //
 // handle an interrupt, exception, or system call from user space.
 // called from trampoline.S
@@ -73,41 +396,12 @@ usertrap(void)
   } else if((which_dev = devintr()) != 0){
     // ok
   } else {
-    if (r_scause() != 0xd && r_scause() != 0xf) {
+    // instruction, load or store page fault
+    if (r_scause() != 0xc && r_scause() != 0xd && r_scause() != 0xf) {
       goto bad;
     }
-    const uint64 addr = r_stval();
-    struct vma *vma = 0;
-    for (int i = 0; i < 16; ++i) {
-      if (p->vmas_[i].valid_ && p->vmas_[i].va_ <= addr && (p->vmas_[i].va_ + p->vmas_[i].len_) > addr) {
-        vma = &(p->vmas_[i]);
-        break;
-      }
-    }
-
-    if (vma == 0) {
+    if (pagefault(r_stval(), r_scause() == 0xf) < 0) {
       goto bad;
-    } else {
-      uint64 pa = (uint64)kalloc();
-      if (pa == 0) {  // cannot allocate page!
-        goto bad;
-      }
-      memset((void *)pa, 0, PGSIZE);
-      int mask = PTE_U | PTE_V;
-      if (vma->prot_ & PROT_READ) {
-        mask |= PTE_R;
-      }
-      if (vma->prot_ & PROT_WRITE) {
-        mask |= PTE_W;
-      }
-      if (mappages(p->pagetable, PGROUNDDOWN(addr), PGSIZE, pa, mask) != 0) {
-        kfree((void *)pa);
-        goto bad;
-      }
-      struct inode *node = vma->file_->ip;
-      ilock(node);
-      readi(node, 1, addr, addr - vma->va_, PGSIZE);
-      iunlock(node);
     }
   }
 
@@ -122,8 +416,14 @@ usertrap(void)
     exit(-1);
 
   // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2)
+  if(which_dev == 2){
+    // let the flusher see stores to shared mappings.
+    if(ticks - p->flushed_ >= FLUSHTICKS){
+      p->flushed_ = ticks;
+      mmapharvest(p);
+    }
     yield();
+  }
 
   usertrapret();
 }
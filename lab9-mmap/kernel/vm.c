@@ -5,6 +5,8 @@
 #include "riscv.h"
 #include "defs.h"
 #include "fs.h"
+#include "spinlock.h"
+#include "proc.h"
 
 /*
  * the kernel's page table.
@@ -175,7 +177,10 @@ safe_uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
       panic("uvmunmap(safe): not a leaf");
     if(do_free && (*pte & PTE_V)){
       uint64 pa = PTE2PA(*pte);
-      kfree((void*)pa);
+      if(*pte & PTE_PC)
+        pcache_put(pa);
+      else
+        kfree((void*)pa);
     }
     *pte = 0;
   }
@@ -195,14 +200,20 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
   for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
     if((pte = walk(pagetable, a, 0)) == 0)
       panic("uvmunmap: walk");
-    if((*pte & PTE_V) == 0)
-    continue;
+    if((*pte & PTE_V) == 0){
+      // drop a PTE_Z marker too.
+      *pte = 0;
+      continue;
+    }
     //   panic("uvmunmap: not mapped");
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
     if(do_free){
       uint64 pa = PTE2PA(*pte);
-      kfree((void*)pa);
+      if(*pte & PTE_PC)
+        pcache_put(pa);
+      else
+        kfree((void*)pa);
     }
     *pte = 0;
   }
@@ -265,6 +276,28 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
   return newsz;
 }
 
+// Reserve user pages to grow process from oldsz to newsz without
+// allocating them: each is marked PTE_Z, for pagefault() to fill
+// in on first touch. Returns new size or 0 on error.
+uint64
+uvmlazy(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
+{
+  pte_t *pte;
+  uint64 a;
+
+  if(newsz < oldsz)
+    return oldsz;
+
+  for(a = PGROUNDUP(oldsz); a < newsz; a += PGSIZE){
+    if((pte = walk(pagetable, a, 1)) == 0)
+      return 0;
+    if(*pte & PTE_V)
+      panic("uvmlazy: remap");
+    *pte = PTE_Z;
+  }
+  return newsz;
+}
+
 // Deallocate user pages to bring the process size from oldsz to
 // newsz.  oldsz and newsz need not be page-aligned, nor does newsz
 // need to be less than oldsz.  oldsz can be larger than the actual
@@ -330,11 +363,22 @@ uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
   for(i = 0; i < sz; i += PGSIZE){
     if((pte = walk(old, i, 0)) == 0)
       panic("uvmcopy: pte should exist");
-    if((*pte & PTE_V) == 0)
-    continue;
+    if((*pte & PTE_V) == 0){
+      // keep pages dropped by madvise() zero-fill in the child.
+      if((*pte & PTE_Z) && (pte = walk(new, i, 1)) != 0)
+        *pte = PTE_Z;
+      continue;
+    }
     //   panic("uvmcopy: page not present");
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
+    if(flags & PTE_PC){
+      // page cache frames are shared, not copied.
+      if(mappages(new, i, PGSIZE, pa, flags) != 0)
+        goto err;
+      pcache_dup(pa);
+      continue;
+    }
     if((mem = kalloc()) == 0)
       goto err;
     memmove(mem, (char*)pa, PGSIZE);
@@ -363,6 +407,53 @@ uvmclear(pagetable_t pagetable, uint64 va)
   *pte &= ~PTE_U;
 }
 
+// Return the physical address of the user page at va for
+// copyin()/copyout(), or 0. If the page is missing, or is
+// read-only and write is set, try to fault it in the way a
+// user access would. That may sleep, so it is skipped when
+// the caller holds a spinlock.
+static uint64
+uvmpage(pagetable_t pagetable, uint64 va, int write)
+{
+  struct proc *p = myproc();
+  pte_t *pte;
+
+  if(va >= MAXVA)
+    return 0;
+  for(int i = 0; i < 2; i++){
+    pte = walk(pagetable, va, 0);
+    if(pte != 0 && (*pte & PTE_V) && (*pte & PTE_U) &&
+       (!write || (*pte & PTE_W))){
+      // the kernel's stores don't go through this PTE, so mark
+      // it the way the hardware would have, for msync() and the
+      // flusher to see.
+      if(write)
+        *pte |= PTE_A|PTE_D;
+      return PTE2PA(*pte);
+    }
+    if(i > 0 || p == 0 || p->pagetable != pagetable || mycpu()->noff > 0)
+      break;
+    if(pagefault(va, write) < 0)
+      break;
+  }
+  return 0;
+}
+
+// Fault in the pages of the current process in [va, va+len),
+// so that copyin()/copyout() find them even when the caller
+// holds a spinlock, as pipes, the console and wait() do, or an
+// inode's lock, which a fault on another file's mapping would
+// take too.
+void
+uvmprefault(uint64 va, uint64 len, int write)
+{
+  pagetable_t pagetable = myproc()->pagetable;
+
+  for(uint64 a = PGROUNDDOWN(va); a < va + len; a += PGSIZE)
+    if(uvmpage(pagetable, a, write) == 0)
+      break;
+}
+
 // Copy from kernel to user.
 // Copy len bytes from src to virtual address dstva in a given page table.
 // Return 0 on success, -1 on error.
@@ -373,7 +464,7 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmpage(pagetable, va0, 1);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (dstva - va0);
@@ -398,7 +489,7 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmpage(pagetable, va0, 0);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
@@ -425,7 +516,7 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmpage(pagetable, va0, 0);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
@@ -238,6 +238,42 @@ mmap_test(void)
   munmap(p2, PGSIZE);
   
   printf("test mmap two files: OK\n");
+
+  printf("test msync\n");
+
+  // stores made visible with msync() must be in the file
+  // while the mapping is still there. MS_INVALIDATE drops the
+  // cached pages, which would otherwise serve read() whether
+  // msync() wrote them or not, so this reads the disk.
+  makefile(f);
+  if ((fd = open(f, O_RDWR)) == -1)
+    err("open");
+  p = mmap(0, PGSIZE*2, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap (6)");
+  for (i = 0; i < PGSIZE; i++)
+    p[i] = 'Y';
+  if (msync(p, PGSIZE*2, MS_ASYNC | MS_SYNC) != -1)
+    err("msync should have failed");
+  if (msync(p, PGSIZE*2, MS_SYNC | MS_INVALIDATE) == -1)
+    err("msync");
+  for (i = 0; i < PGSIZE; i++){
+    char b;
+    if (read(fd, &b, 1) != 1)
+      err("read (2)");
+    if (b != 'Y')
+      err("file does not contain msync()ed modifications");
+  }
+  // the mapping faults the page in again, from the file.
+  for (i = 0; i < PGSIZE; i++)
+    if (p[i] != 'Y')
+      err("mapping lost msync()ed modifications");
+  if (munmap(p, PGSIZE*2) == -1)
+    err("munmap (5)");
+  if (close(fd) == -1)
+    err("close");
+
+  printf("test msync: OK\n");
   
   printf("mmap_test: ALL OK\n");
 }
@@ -292,6 +328,31 @@ fork_test(void)
   _v1(p1);
   _v1(p2);
 
+  // anonymous memory starts out zeroed; after fork() the
+  // child shares a shared mapping but gets its own copy of
+  // a private one.
+  char *s = mmap(0, PGSIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  char *q = mmap(0, PGSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (s == MAP_FAILED || q == MAP_FAILED)
+    err("mmap anonymous");
+  if (s[0] != 0 || q[PGSIZE-1] != 0)
+    err("anonymous memory not zeroed");
+  q[0] = 'P';
+  if((pid = fork()) < 0)
+    err("fork");
+  if (pid == 0) {
+    s[0] = 'C';
+    q[0] = 'C';
+    exit(0);
+  }
+  wait(&status);
+  if (s[0] != 'C')
+    err("shared anonymous mapping not shared");
+  if (q[0] != 'P')
+    err("private anonymous mapping not private");
+  if (munmap(s, PGSIZE) == -1 || munmap(q, PGSIZE) == -1)
+    err("munmap anonymous");
+
   printf("fork_test OK\n");
 }
 
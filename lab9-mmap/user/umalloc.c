@@ -2,6 +2,8 @@
 #include "kernel/stat.h"
 #include "user/user.h"
 #include "kernel/param.h"
+#include "kernel/fcntl.h"
+#include "kernel/riscv.h"
 
 // Memory allocator by Kernighan and Ritchie,
 // The C programming Language, 2nd ed.  Section 8.7.
@@ -21,8 +23,25 @@ typedef union header Header;
 static Header base;
 static Header *freep;
 
-void
-free(void *ap)
+// free blocks spanning at least this many whole pages
+// give those pages back to the kernel.
+#define RELEASE_PAGES 4
+
+// Return the whole pages inside free block bp to the kernel,
+// keeping the page that holds its header. They read as
+// zero when the block is handed out again.
+static void
+releasepages(Header *bp)
+{
+  uint64 start = PGROUNDUP((uint64)(bp + 1));
+  uint64 end = PGROUNDDOWN((uint64)(bp + bp->s.size));
+
+  if(end > start && end - start >= RELEASE_PAGES*PGSIZE)
+    madvise((void*)start, end - start, MADV_DONTNEED);
+}
+
+static void
+insert(void *ap, int giveback)
 {
   Header *bp, *p;
 
@@ -38,9 +57,18 @@ free(void *ap)
   if(p + p->s.size == bp){
     p->s.size += bp->s.size;
     p->s.ptr = bp->s.ptr;
+    bp = p;
   } else
     p->s.ptr = bp;
   freep = p;
+  if(giveback)
+    releasepages(bp);
+}
+
+void
+free(void *ap)
+{
+  insert(ap, 1);
 }
 
 static Header*
@@ -56,7 +84,9 @@ morecore(uint nu)
     return 0;
   hp = (Header*)p;
   hp->s.size = nu;
-  free((void*)(hp + 1));
+  // fresh from sbrk(): keep it, or malloc() would have to
+  // fault it back in page by page.
+  insert((void*)(hp + 1), 0);
   return freep;
 }
 
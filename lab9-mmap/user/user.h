@@ -31,6 +31,8 @@ int sleep(int);
 int uptime(void);
 void *mmap(void *addr, uint64 length, int prot, int flags, int fd, uint offset);
 int munmap(void *addr, uint64 length);
+int msync(void *addr, uint64 length, int flags);
+int madvise(void *addr, uint64 length, int advice);
 
 // ulib.c
 int stat(const char*, struct stat*);